@@ -14,24 +14,244 @@
 #include <opencv2/opencv.hpp>
 #include <iostream>
 #include <iomanip>
-#include <list>
+#include <deque>
+#include <map>
+#include <vector>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <chrono>
 #include <cstdlib>
+#include <cmath>
+#include <climits>
+#include <sstream>
+#include <fstream>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
 #include <signal.h> // POSIX specific code will be used for ctrl-c handling
+#include <fcntl.h> // POSIX file mapping and vectored writes for native y4m/yuv input and output
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h> // local job socket for -serve and -submit
+#include <sys/un.h>
+#ifdef __linux__
+#include <sched.h> // thread affinity for -cpus and -numa_node
+#include <pthread.h>
+#include <sys/syscall.h> // dTLB miss counting with perf events
+#include <linux/perf_event.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Building with -DFRAMEFIXER_LIBAV decodes and encodes through libavcodec directly for the native yuv pipeline
+#ifdef FRAMEFIXER_LIBAV
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/motion_vector.h>
+#include <libswscale/swscale.h>
+}
+#endif
 
 using namespace std;
 using namespace cv;
 
-// Struct to hold the frames and associated info
-struct Frame {
+// Frames in flight, oldest first, in a fixed ring of slots
+// the metadata the allocator scans lives in parallel arrays indexed by slot, apart from the pixel data,
+// so donor searches read contiguous ints and doubles instead of chasing a pointer per frame;
+// the pixels stay in the frame pool and a slot only holds the handle of its pooled frame
+class FrameRing {
+public:
+	vector<int> handle; // index into FRAME_POOL
+	vector<int> count;
+	vector<double> priority;
+	vector<int> index; // track the frame's original index when read to keep writing index within bounds
+	vector<int> required; // slots this frame needs to survive downsampling, varies with a rational cadence
+	vector<unsigned char> cut; // first frame of a new scene, frames on either side don't trade slots
+	void reset(int slots) {
+		capacity = slots;
+		head = 0;
+		length = 0;
+		handle.assign(slots,-1);
+		count.assign(slots,0);
+		priority.assign(slots,0.0);
+		index.assign(slots,0);
+		required.assign(slots,2);
+		cut.assign(slots,0);
+	}
+	int size() const {
+		return length;
+	}
+	// slot holding the frame at a position, 0 being the oldest
+	int at(int position) const {
+		int slot = head + position;
+		return (slot >= capacity) ? slot - capacity : slot;
+	}
+	int front() const {
+		return head;
+	}
+	int back() const {
+		return at(length - 1);
+	}
+	// claims the slot after the newest frame and returns it
+	int push() {
+		length++;
+		return back();
+	}
+	void pop() {
+		head = at(1);
+		length--;
+	}
+	// newest slot among positions [first, last) passing the test, -1 if none
+	// positions map to at most two contiguous runs of slots, each scanned with a plain loop over the arrays
+	template <typename Test>
+	int findNewest(int first, int last, Test test) const {
+		int start = at(first), n = last - first;
+		int run = min(n,capacity - start); // slots start..start+run-1, anything after wraps around to slot 0
+		for (int slot = n - run - 1; slot >= 0; slot--) {
+			if (test(slot)) return slot;
+		}
+		for (int slot = start + run - 1; slot >= start; slot--) {
+			if (test(slot)) return slot;
+		}
+		return -1;
+	}
+private:
+	int capacity = 0;
+	int head = 0;
+	int length = 0;
+};
+
+// Bounded single-producer single-consumer queue carrying frame handles between two pipeline stages
+// each side only stores its own index, so a push or pop is a couple of loads and a store with no lock;
+// a side that can't proceed spins, then yields, then parks on a condition variable,
+// which the other side only touches when something is actually parked
+template <typename T>
+class SpscRing {
+public:
+	// occupancy after each push, kept by the producer and read once both stages have finished
+	uint64_t pushes = 0;
+	uint64_t occupancy = 0;
+	int peak = 0;
+	atomic<int> parks{0};
+	void reset(int slots) {
+		int capacity = 1;
+		while (capacity < slots) capacity <<= 1; // power of two, so positions wrap with a mask
+		items.assign(capacity,T());
+		mask = capacity - 1;
+		head.store(0);
+		tail.store(0);
+		pushes = occupancy = 0;
+		peak = 0;
+		parks.store(0);
+	}
+	int capacity() const {
+		return (int)items.size(); // 0 until reset
+	}
+	// safe from any thread, e.g. the reporter, though it may be a frame out of date
+	int size() const {
+		return (int)(tail.load(memory_order_acquire) - head.load(memory_order_acquire));
+	}
+	bool tryPush(const T& item) {
+		size_t t = tail.load(memory_order_relaxed);
+		size_t used = t - head.load(memory_order_acquire);
+		if (used > mask) return false;
+		items[t & mask] = item;
+		tail.store(t + 1,memory_order_release);
+		pushes++;
+		occupancy += used + 1;
+		peak = max(peak,(int)used + 1);
+		wake();
+		return true;
+	}
+	bool tryPop(T& item) {
+		size_t h = head.load(memory_order_relaxed);
+		if (tail.load(memory_order_acquire) == h) return false;
+		item = items[h & mask];
+		head.store(h + 1,memory_order_release);
+		wake();
+		return true;
+	}
+	void push(const T& item) {
+		while (!tryPush(item)) wait([this]() { return size() <= (int)mask; });
+	}
+	void pop(T& item) {
+		while (!tryPop(item)) wait([this]() { return size() > 0; });
+	}
+private:
+	static const int SPINS = 256; // about a microsecond, covers a stage that is just finishing its frame
+	static const int YIELDS = 64;
+	vector<T> items;
+	size_t mask = 0;
+	alignas(64) atomic<size_t> head{0}; // next position to pop, written by the consumer
+	alignas(64) atomic<size_t> tail{0}; // next position to push, written by the producer
+	alignas(64) atomic<int> parked{0};
+	mutex park_mutex;
+	condition_variable park_signal;
+	void wake() {
+		atomic_thread_fence(memory_order_seq_cst); // the index store must be visible before parked is checked
+		if (parked.load(memory_order_relaxed) > 0) {
+			lock_guard<mutex> lock(park_mutex);
+			park_signal.notify_all();
+		}
+	}
+	template <typename Ready>
+	void wait(Ready ready) {
+		for (int i = 0; i < SPINS; i++) {
+			if (ready()) return;
+#ifdef __SSE2__
+			_mm_pause();
+#endif
+		}
+		for (int i = 0; i < YIELDS; i++) {
+			if (ready()) return;
+			this_thread::yield();
+		}
+		unique_lock<mutex> lock(park_mutex);
+		parked++;
+		atomic_thread_fence(memory_order_seq_cst); // pairs with wake, one side always sees the other
+		parks++;
+		while (!ready()) {
+			park_signal.wait_for(lock,chrono::milliseconds(10));
+		}
+		parked--;
+	}
+};
+
+// A frame and everything the decode stage derived from it, moved between stages as its index in FRAME_POOL
+// a handle goes decode -> match -> encode -> back to decode, so only one stage touches a pooled frame at a time
+struct PooledFrame {
 	Mat data;
 	Mat comp;
-	int count = 0;
-	double priority = 0.0;
-	int index; // track the frame's original index when read to keep writing index within bounds
+	Mat coarse;
+	int index = 0; // position in the input
+	bool read = false; // false marks the end of the input, with no picture
+	// codec hints of this frame, copied since the source has moved on by the time it's matched
+	bool hinted = false;
+	bool still = false;
+	double coded_bpp = 0.0;
+	double stdev = 0.0; // against the frame before it, kept so the buffer can be re-ranked without hints
+};
+
+// What the encode stages do with a handle: write the frame over a run of slots (possibly none) and free it, or stop on -1
+// slots are at the input fps, so each output picks the ones its own rate samples
+struct EncodeJob {
+	int handle;
+	long long slot; // first slot the frame fills
+	int slots;
 };
 
+
 // Threshold will have high and low settings
 // "strict" requires very large changes before it will consider the frame as new
 // "relaxed" allows the frame to be considered new with much less overall change
@@ -45,76 +265,1946 @@ public:
 	void makeStrict() {
 		value = strict;
 	}
-	void makeRelaxed() {
-		value = relaxed;
+	void makeRelaxed() {
+		value = relaxed;
+	}
+	// replace both thresholds, staying in whichever mode is active
+	void update(double new_strict, double new_relaxed) {
+		bool was_strict = (value == strict);
+		strict = new_strict;
+		relaxed = new_relaxed;
+		value = was_strict ? strict : relaxed;
+	}
+};
+
+// Calibrator fits the strict threshold between the two modes of the stdev distribution
+// duplicates cluster near the noise floor and real changes sit orders of magnitude above it,
+// so Otsu's method on a log-scale histogram separates them without any per-title tuning
+// relaxed keeps its configured ratio to strict (half by default)
+class Calibrator {
+public:
+	int window = 0; // frames read before processing to calibrate, 0 disables
+	int interval = 0; // re-estimate after this many comparisons while processing, 0 disables
+	double separation = 0.0; // share of log-stdev variance explained by the split, 1 is perfectly bimodal
+	// collect a stdev from the main loop, re-estimating once enough have been seen
+	void add(double stdev);
+	// sets THRESH from the samples; returns false and leaves it alone if they don't show two separate modes
+	bool fit(const vector<double>& stdevs);
+private:
+	vector<double> samples;
+};
+bool fitThreshold(const vector<double>& stdevs, double& threshold, double& separation);
+
+// SceneCuts flags frames whose stdev spikes far above the recent level of changes
+// across a hard cut everything is new, so the allocator treats each side as its own segment
+class SceneCuts {
+public:
+	double ratio = 0.0; // a change this many times the running change level is a cut, 0 disables
+	vector<int> cuts; // frame indexes where scenes start, reported as split points
+	// feed the stdev of each new frame, returns true when it starts a new scene
+	bool check(double stdev, int index) {
+		if (ratio <= 0) return false;
+		bool cut = (seen >= WARMUP && stdev > ratio*level);
+		if (cut) {
+			cuts.push_back(index);
+		} else { // cuts stay out of the level, or one would mask the next
+			level = (seen == 0) ? stdev : level + ALPHA*(stdev - level);
+			seen++;
+		}
+		return cut;
+	}
+private:
+	static constexpr double ALPHA = 0.1;
+	static const int WARMUP = 8;
+	double level = 0.0;
+	int seen = 0;
+};
+
+// NoiseTracker follows the noise floor of the source as it plays and raises the thresholds over noisy stretches
+// once noise pushes duplicates over the threshold they no longer look like duplicates, so rather than averaging matches,
+// it tracks a low and a high quantile of every measured stdev (exponentially weighted, in log space so it's scale-free):
+// the low one sits in the duplicate cluster and the high one in the changes, as long as the two are clearly apart
+// a deadband keeps small wobbles in the estimate from moving the thresholds every frame
+class NoiseTracker {
+public:
+	double margin = 0.0; // effective strict threshold is at least this many times the noise floor, 0 disables
+	double floor = 0.0; // tracked low quantile of the stdevs
+	double ceiling = 0.0; // tracked high quantile of the stdevs
+	int adjustments = 0;
+	double highest = 0.0; // largest strict threshold applied, for the summary
+	// takes the current thresholds as the base the tracker can only raise from
+	void rebase();
+	// feed every measured stdev; costs a few flops
+	void add(double stdev);
+private:
+	static constexpr double LOW = 0.2, HIGH = 0.8; // quantiles tracked, any downsampling source has far more than 20% duplicates
+	static constexpr double RATE = 0.1; // log-space step, settles within a few dozen frames
+	static constexpr double DEADBAND = 0.15; // relative change needed before the thresholds move
+	static const int WARMUP = 30;
+	double base_strict = 0.0, base_relaxed = 0.0;
+	double log_floor = 0.0, log_ceiling = 0.0;
+	int seen = 0;
+};
+
+// Cadence is a rational number of slots per content frame, num/den
+// integer ratios like 60 -> 30 are 2/1, but 3:2 pulldown (24 in 60) is 5/2 and 30 in 50 is 5/3
+// a decimation at this rate samples the slots ceil(k*num/den), so 5/2 picks slots 0,3,5,8,10,... with gaps of 3,2,3,2
+// everything is exact integer math, so the schedule never drifts from rounding over long videos
+class Cadence {
+public:
+	long long num = 2;
+	long long den = 1;
+	// approximate a ratio such as 59.94/23.976 with the smallest fraction that fits it
+	void set(double ratio) {
+		for (long long d = 1; d <= 1000; d++) {
+			long long n = llround(ratio*d);
+			if (n > 0 && fabs(ratio - (double)n/d) < 0.0005) {
+				num = n;
+				den = d;
+				return;
+			}
+		}
+		num = llround(ratio*1000);
+		den = 1000;
+	}
+	double value() const {
+		return (double)num/den;
+	}
+	// first slot at or after output frame k's timestamp
+	long long pick(long long k) const {
+		return (k*num + den - 1)/den;
+	}
+	// first picked slot at or after slot s
+	long long nextPick(long long s) const {
+		return (s <= 0) ? 0 : pick((s - 1)*den/num + 1);
+	}
+};
+
+// CadenceTracker watches duplicate run lengths from the fill loop and locks onto a repeating pattern
+// steady 30 fps content in 60 fps video gives runs of 2,2,2,... and 3:2 pulldown gives 3,2,3,2,...
+// once locked, the run being filled is predicted to be as long as the run one period back (its phase in the pattern)
+// so the remaining duplicates of that run only need a cheap confirmation instead of a full comparison
+class CadenceTracker {
+public:
+	bool enabled = false;
+	int period = 0; // length of the locked pattern in runs, 0 when unlocked
+	long long comparisons = 0, skipped = 0, misses = 0;
+	// record a finished run, checking it against the prediction and trying to lock if unlocked
+	void push(int run) {
+		if (period > 0 && run != predicted()) {
+			unlock();
+		}
+		runs.push_back(run);
+		if (runs.size() > HISTORY) runs.pop_front();
+		if (period == 0) detect();
+	}
+	// true if locked and the current run still has predicted duplicates left
+	bool expectsDuplicate(int count) const {
+		return enabled && period > 0 && count < predicted();
+	}
+	void unlock() {
+		period = 0;
+		misses++;
+	}
+private:
+	static const size_t HISTORY = 16;
+	static const int MAX_PERIOD = 4;
+	static const int REPEATS = 3; // pattern must repeat this many times before locking
+	deque<int> runs;
+	int predicted() const {
+		return runs[runs.size() - period];
+	}
+	// find the shortest period whose pattern repeats over the most recent runs
+	void detect() {
+		for (int p = 1; p <= MAX_PERIOD; p++) {
+			size_t n = p*REPEATS;
+			if (n > runs.size()) break;
+			bool repeating = true;
+			for (size_t i = runs.size() - n + p; repeating && i < runs.size(); i++) {
+				repeating = (runs[i] == runs[i - p]);
+			}
+			if (repeating) {
+				period = p;
+				return;
+			}
+		}
+	}
+};
+
+// Writers store the rate as a fraction, keep NTSC rates like 59.94 exact (60000/1001)
+void rationalFps(double fps, int& num, int& den) {
+	double ntsc = fps*1.001;
+	if (fabs(fps - lround(fps)) > 0.001 && fabs(ntsc - lround(ntsc)) < 0.001) {
+		num = lround(ntsc)*1000;
+		den = 1001;
+	} else {
+		num = lround(fps*1000);
+		den = 1000;
+		while (num % 10 == 0 && den % 10 == 0) {
+			num /= 10;
+			den /= 10;
+		}
+	}
+}
+
+// Sources hand out frames for buffering, comparison and output
+// OpenCV's capture decodes to BGR; native readers hand out planar I420 (all Y rows, then U, then V) as a single Mat
+// high bit depth I420 comes as CV_16U holding the samples unscaled, e.g. 0-1023 for 10-bit
+class Source {
+public:
+	int width = 0;
+	int height = 0;
+	int length = 0;
+	double fps = 0.0;
+	int fourcc = 0; // codec of the input when it has one, 0 for raw video
+	int codec_id = 0; // libavcodec id of the input codec, when decoded by libavcodec
+	string codec; // reported at startup
+	bool planar = false; // frames are I420 rather than BGR
+	int bits = 8; // significant bits per sample, more than 8 means CV_16U frames
+	bool stable = false; // frames read into separate Mats stay valid after later reads, so the decode stage reads straight into the pool
+	bool file_views = false; // frames are views of the input file, so the pool allocates nothing for them
+	// what the decoder knew about the last frame read, when the source exports codec statistics
+	bool hinted = false; // the fields below describe the last frame
+	double coded_bpp = 0.0; // bits the encoder spent on the frame per pixel, residual plus motion cost
+	double motion = 0.0; // mean motion vector length in pixels, weighted by block area
+	bool still = false; // P frame copied whole from the past with no motion and next to no residual, i.e. the encoder saw a duplicate
+	virtual ~Source() {}
+	virtual bool read(Mat& frame) = 0;
+	// position so the next read returns the given frame, returns the index actually reached
+	virtual int seek(int index) = 0;
+	virtual void release() = 0;
+};
+
+// Wraps OpenCV's VideoCapture for every container and codec it supports
+class CaptureSource : public Source {
+public:
+	bool open(const string& name) {
+		cap.open(name);
+		if (!cap.isOpened()) return false;
+		// Default resolution of the frame is obtained. The default resolution is system dependent.
+		width = cap.get(CAP_PROP_FRAME_WIDTH);
+		height = cap.get(CAP_PROP_FRAME_HEIGHT);
+		length = cap.get(CAP_PROP_FRAME_COUNT);
+		fps = cap.get(CAP_PROP_FPS);
+		fourcc = cap.get(CAP_PROP_FOURCC);
+		codec = cv::format("%c%c%c%c", fourcc & 255, (fourcc >> 8) & 255, (fourcc >> 16) & 255, (fourcc >> 24) & 255);
+		return true;
+	}
+	bool read(Mat& frame) {
+		cap >> frame;
+		return !frame.empty();
+	}
+	int seek(int index) {
+		cap.set(CAP_PROP_POS_FRAMES,index);
+		return cap.get(CAP_PROP_POS_FRAMES);
+	}
+	void release() {
+		cap.release();
+	}
+private:
+	VideoCapture cap;
+};
+
+// Memory-maps Y4M or headerless raw I420 files; frames are Mat views straight into the mapping, so nothing is decoded or copied
+// 4:2:0 at 8 bits, or 10/12/16 bits stored little-endian in 16-bit words, covers the lossless intermediates these files are used for
+class RawSource : public Source {
+public:
+	~RawSource() {
+		release();
+	}
+	// y4m reads its own header, raw .yuv needs the dimensions and rate given
+	bool open(const string& name, int raw_width, int raw_height, double raw_fps, int raw_bits) {
+		fd = ::open(name.c_str(),O_RDONLY);
+		if (fd < 0) return false;
+		struct stat info;
+		if (fstat(fd,&info) != 0 || info.st_size == 0) return false;
+		size = info.st_size;
+		void* mapped = mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+		if (mapped == MAP_FAILED) return false;
+		base = (unsigned char*)mapped;
+		madvise(base,size,MADV_SEQUENTIAL); // let the kernel read ahead at full disk speed
+		y4m = (size >= 9 && memcmp(base,"YUV4MPEG2",9) == 0);
+		if (y4m) {
+			if (!parseHeader()) return false;
+			codec = "Y4M";
+		} else {
+			width = raw_width;
+			height = raw_height;
+			fps = raw_fps;
+			bits = raw_bits;
+			codec = "YUV";
+		}
+		if (width <= 0 || height <= 0 || fps <= 0 || width % 2 != 0 || height % 2 != 0) return false;
+		if (bits != 8 && bits != 10 && bits != 12 && bits != 16) return false;
+		frame_size = (size_t)width*height*3/2*(bits > 8 ? 2 : 1);
+		length = (size - data_start)/(frame_size + (y4m ? 6 : 0));
+		offset = data_start;
+		planar = true;
+		stable = true;
+		file_views = true;
+		return true;
+	}
+	bool read(Mat& frame) {
+		if (y4m) {
+			// each frame starts with "FRAME", optionally followed by parameters, up to a newline
+			if (offset + 6 > size || memcmp(base + offset,"FRAME",5) != 0) return false;
+			const unsigned char* end = (const unsigned char*)memchr(base + offset,'\n',size - offset);
+			if (end == NULL) return false;
+			offset = end - base + 1;
+		}
+		if (offset + frame_size > size) return false;
+		frame = Mat(height*3/2,width,bits > 8 ? CV_16UC1 : CV_8UC1,base + offset);
+		offset += frame_size;
+		return true;
+	}
+	int seek(int index) {
+		// assumes bare "FRAME" headers, which is how ffmpeg and most tools write them; otherwise the next read fails
+		offset = min(size,data_start + (size_t)index*(frame_size + (y4m ? 6 : 0)));
+		return index;
+	}
+	void release() {
+		if (base != NULL) munmap(base,size);
+		base = NULL;
+		if (fd >= 0) close(fd);
+		fd = -1;
+	}
+private:
+	int fd = -1;
+	unsigned char* base = NULL;
+	size_t size = 0;
+	size_t data_start = 0;
+	size_t frame_size = 0;
+	size_t offset = 0;
+	bool y4m = false;
+	bool parseHeader() {
+		const unsigned char* end = (const unsigned char*)memchr(base,'\n',size);
+		if (end == NULL) return false;
+		string header((const char*)base + 9,end - base - 9);
+		data_start = end - base + 1;
+		string colorspace = "420jpeg"; // the y4m default when no C tag is given
+		istringstream tags(header);
+		string tag;
+		while (tags >> tag) {
+			if (tag[0] == 'W') width = atoi(tag.c_str() + 1);
+			else if (tag[0] == 'H') height = atoi(tag.c_str() + 1);
+			else if (tag[0] == 'C') colorspace = tag.substr(1);
+			else if (tag[0] == 'F') {
+				int num = 0, den = 0;
+				if (sscanf(tag.c_str() + 1,"%d:%d",&num,&den) == 2 && den > 0) fps = (double)num/den;
+			}
+		}
+		if (colorspace == "420p10") bits = 10;
+		else if (colorspace == "420p12") bits = 12;
+		else if (colorspace == "420p16") bits = 16;
+		else return colorspace == "420" || colorspace == "420jpeg" || colorspace == "420mpeg2" || colorspace == "420paldv";
+		return true;
+	}
+};
+
+// Encoder choice and rate control from the command line; empty or 0 keeps the encoder's own default
+struct EncoderSettings {
+	string name; // libavcodec encoder like libx264, or a fourcc for OpenCV's writer
+	int threads = 0; // libav builds use one per core when 0
+	string preset;
+	double crf = -1.0; // -1 keeps the default, 0 is lossless on encoders like libx264
+	double bitrate = 0.0; // kbit/s
+	bool configured() const {
+		return !name.empty() || threads > 0 || !preset.empty() || crf >= 0 || bitrate > 0;
+	}
+};
+
+// Sinks store or encode frames; repeats lets a sink emit the same frame several times for the cost of one
+class Sink {
+public:
+	virtual ~Sink() {}
+	virtual void write(const Mat& frame, int repeats) = 0;
+	virtual void release() = 0;
+};
+
+// Wraps OpenCV's VideoWriter, which takes 8-bit BGR
+class WriterSink : public Sink {
+public:
+	bool open(const string& name, int fourcc, double fps, Size size, int source_bits) {
+		bits = source_bits;
+		writer.open(name,fourcc,fps,size);
+		return writer.isOpened();
+	}
+	void write(const Mat& frame, int repeats) {
+		const Mat* out = &frame;
+		if (frame.channels() == 1) { // planar frames convert once no matter how often they repeat
+			if (frame.depth() == CV_16U) {
+				frame.convertTo(narrow,CV_8U,1.0/(1 << (bits - 8)));
+				cvtColor(narrow,bgr,COLOR_YUV2BGR_I420);
+			} else {
+				cvtColor(frame,bgr,COLOR_YUV2BGR_I420);
+			}
+			out = &bgr;
+		}
+		for (int i = 0; i < repeats; i++) {
+			writer.write(*out);
+		}
+	}
+	void release() {
+		writer.release();
+	}
+private:
+	VideoWriter writer;
+	int bits = 8;
+	Mat narrow;
+	Mat bgr;
+};
+
+// Writes Y4M or raw I420; repeats point several iovecs at the same frame buffer and go out in one writev
+class RawSink : public Sink {
+public:
+	~RawSink() {
+		release();
+	}
+	bool open(const string& name, bool with_header, int width, int height, double fps, int bits) {
+		fd = ::open(name.c_str(),O_WRONLY | O_CREAT | O_TRUNC,0644);
+		if (fd < 0) return false;
+		y4m = with_header;
+		frame_size = (size_t)width*height*3/2*(bits > 8 ? 2 : 1);
+		if (y4m) {
+			int num, den;
+			rationalFps(fps,num,den);
+			string colorspace = (bits > 8) ? cv::format("420p%d",bits) : string("420jpeg");
+			string header = cv::format("YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C%s\n",width,height,num,den,colorspace.c_str());
+			vector<iovec> iov(1);
+			iov[0].iov_base = (void*)header.data();
+			iov[0].iov_len = header.size();
+			return writeVectors(iov);
+		}
+		return true;
+	}
+	void write(const Mat& frame, int repeats) {
+		const Mat* out = &frame;
+		if (frame.channels() == 3) {
+			cvtColor(frame,yuv,COLOR_BGR2YUV_I420);
+			out = &yuv;
+		} else if (!frame.isContinuous()) {
+			yuv = frame.clone();
+			out = &yuv;
+		}
+		vector<iovec> iov;
+		for (int i = 0; i < repeats; i++) {
+			iovec piece;
+			if (y4m) {
+				piece.iov_base = (void*)FRAME_HEADER;
+				piece.iov_len = 6;
+				iov.push_back(piece);
+			}
+			piece.iov_base = (void*)out->data;
+			piece.iov_len = frame_size;
+			iov.push_back(piece);
+		}
+		if (!writeVectors(iov)) {
+			cout << "Error writing raw output: " << strerror(errno) << endl;
+		}
+	}
+	void release() {
+		if (fd >= 0) close(fd);
+		fd = -1;
+	}
+private:
+	static const char FRAME_HEADER[];
+	int fd = -1;
+	size_t frame_size = 0;
+	bool y4m = false;
+	Mat yuv;
+	// writev until everything is out, picking up after partial writes
+	bool writeVectors(vector<iovec>& iov) {
+		size_t first = 0;
+		while (first < iov.size()) {
+			ssize_t written = writev(fd,&iov[first],min(iov.size() - first,(size_t)IOV_MAX));
+			if (written < 0) {
+				if (errno == EINTR) continue;
+				return false;
+			}
+			while (first < iov.size() && (size_t)written >= iov[first].iov_len) {
+				written -= iov[first].iov_len;
+				first++;
+			}
+			if (written > 0) {
+				iov[first].iov_base = (char*)iov[first].iov_base + written;
+				iov[first].iov_len -= written;
+			}
+		}
+		return true;
+	}
+};
+const char RawSink::FRAME_HEADER[] = "FRAME\n";
+
+#ifdef FRAMEFIXER_LIBAV
+// Decodes with libavcodec directly so frames stay in their native 4:2:0 planes instead of being converted to BGR
+// decoders that output another layout (e.g. nv12 from hardware) are repacked to I420, which is still far cheaper than BGR
+// 10 and 12-bit video keeps its depth as 16-bit I420 so subtle differences aren't truncated before comparison
+class LibavSource : public Source {
+public:
+	~LibavSource() {
+		release();
+	}
+	// hints exports motion vectors and packet sizes for the codec priority and prefilter
+	bool open(const string& name, bool with_hints) {
+		hints = with_hints;
+		if (avformat_open_input(&format_ctx,name.c_str(),NULL,NULL) < 0) return false;
+		if (avformat_find_stream_info(format_ctx,NULL) < 0) return false;
+		stream = av_find_best_stream(format_ctx,AVMEDIA_TYPE_VIDEO,-1,-1,NULL,0);
+		if (stream < 0) return false;
+		AVStream* st = format_ctx->streams[stream];
+		const AVCodec* decoder = avcodec_find_decoder(st->codecpar->codec_id);
+		if (decoder == NULL) return false;
+		codec_ctx = avcodec_alloc_context3(decoder);
+		avcodec_parameters_to_context(codec_ctx,st->codecpar);
+		codec_ctx->thread_count = 0; // let libavcodec use every core, frame threading is what keeps decode ahead
+		AVDictionary* options = NULL;
+		if (hints) av_dict_set(&options,"flags2","+export_mvs",0);
+		int opened = avcodec_open2(codec_ctx,decoder,&options);
+		av_dict_free(&options);
+		if (opened < 0) return false;
+		width = codec_ctx->width;
+		height = codec_ctx->height;
+		if (width % 2 != 0 || height % 2 != 0) return false; // I420 needs whole chroma samples
+		const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(codec_ctx->pix_fmt);
+		int depth = (desc != NULL) ? desc->comp[0].depth : 8;
+		// depths without a native layout of their own, e.g. 9 or 11 bits, are scaled up to the full 16
+		if (depth <= 8) target = AV_PIX_FMT_YUV420P;
+		else if (depth == 10) target = AV_PIX_FMT_YUV420P10LE;
+		else if (depth == 12) target = AV_PIX_FMT_YUV420P12LE;
+		else target = AV_PIX_FMT_YUV420P16LE;
+		bits = (target == AV_PIX_FMT_YUV420P16LE) ? 16 : (depth <= 8 ? 8 : depth);
+		time_base = st->time_base;
+		rate = av_guess_frame_rate(format_ctx,st,NULL);
+		fps = av_q2d(rate);
+		start_pts = (st->start_time != AV_NOPTS_VALUE) ? st->start_time : 0;
+		if (st->nb_frames > 0) length = st->nb_frames;
+		else if (format_ctx->duration > 0) length = format_ctx->duration*fps/AV_TIME_BASE;
+		fourcc = st->codecpar->codec_tag;
+		codec_id = st->codecpar->codec_id;
+		codec = decoder->name;
+		planar = true;
+		stable = true; // repack writes into the caller's Mat
+		packet = av_packet_alloc();
+		decoded = av_frame_alloc();
+		return true;
+	}
+	bool read(Mat& frame) {
+		if (!pending && !decode()) return false;
+		pending = false;
+		if (hints) gatherHints();
+		repack(frame);
+		av_frame_unref(decoded);
+		return true;
+	}
+	int seek(int index) {
+		// seek to the keyframe before the target, then decode forward until its timestamp is reached
+		int64_t target = start_pts + av_rescale_q(index,av_inv_q(rate),time_base);
+		if (av_seek_frame(format_ctx,stream,target,AVSEEK_FLAG_BACKWARD) < 0) return 0;
+		avcodec_flush_buffers(codec_ctx);
+		draining = false;
+		while (decode()) {
+			int reached = frameIndex();
+			if (reached >= index) {
+				pending = true; // keep it for the next read
+				return reached;
+			}
+			av_frame_unref(decoded);
+		}
+		return index;
+	}
+	void release() {
+		if (scaler != NULL) sws_freeContext(scaler);
+		scaler = NULL;
+		if (packet != NULL) av_packet_free(&packet);
+		if (decoded != NULL) av_frame_free(&decoded);
+		if (codec_ctx != NULL) avcodec_free_context(&codec_ctx);
+		if (format_ctx != NULL) avformat_close_input(&format_ctx);
+	}
+protected:
+	AVFormatContext* format_ctx = NULL;
+	AVCodecContext* codec_ctx = NULL;
+	AVPacket* packet = NULL;
+	AVFrame* decoded = NULL;
+	SwsContext* scaler = NULL;
+	AVPixelFormat target = AV_PIX_FMT_YUV420P;
+	AVRational time_base;
+	AVRational rate;
+	int64_t start_pts = 0;
+	int stream = -1;
+	bool draining = false;
+	bool pending = false;
+	bool hints = false;
+	const double STILL_BPP = 0.002; // inter frames coded with fewer bits per pixel and no motion are skipped duplicates
+	deque<pair<int64_t,int> > packet_sizes; // (pts, bytes) of packets sent, matched to frames as they come out of the decoder
+	// pulls the next decoded frame into decoded, feeding packets as the decoder asks for them
+	bool decode() {
+		while (true) {
+			int ret = avcodec_receive_frame(codec_ctx,decoded);
+			if (ret == 0) return true;
+			if (ret == AVERROR_EOF || draining) return false;
+			if (av_read_frame(format_ctx,packet) < 0) {
+				avcodec_send_packet(codec_ctx,NULL); // end of file, flush what the decoder still holds
+				draining = true;
+				continue;
+			}
+			if (packet->stream_index == stream) {
+				if (hints) {
+					packet_sizes.push_back(make_pair(packet->pts,packet->size));
+					if (packet_sizes.size() > 64) packet_sizes.pop_front(); // more than any decoder's reorder delay
+				}
+				avcodec_send_packet(codec_ctx,packet);
+			}
+			av_packet_unref(packet);
+		}
+	}
+	// Reads the motion vectors the decoder exported and the size of the packet the frame came from
+	// neither touches pixels, the vectors are a by-product of decoding and the size is known before decoding starts
+	void gatherHints() {
+		hinted = false;
+		int bytes = -1;
+		for (deque<pair<int64_t,int> >::iterator it = packet_sizes.begin(); it != packet_sizes.end(); it++) {
+			if (it->first == decoded->pts) {
+				bytes = it->second;
+				packet_sizes.erase(it);
+				break;
+			}
+		}
+		if (bytes < 0) return;
+		double pixels = (double)width*height;
+		coded_bpp = bytes*8/pixels;
+		motion = 0.0;
+		// intra blocks export no vector, so the vectors only cover the whole picture if every block was predicted
+		double covered = 0.0;
+		bool past = true;
+		AVFrameSideData* side = av_frame_get_side_data(decoded,AV_FRAME_DATA_MOTION_VECTORS);
+		if (side != NULL) {
+			const AVMotionVector* vectors = (const AVMotionVector*)side->data;
+			size_t count = side->size/sizeof(AVMotionVector);
+			for (size_t i = 0; i < count; i++) {
+				double dx = (double)vectors[i].motion_x/vectors[i].motion_scale;
+				double dy = (double)vectors[i].motion_y/vectors[i].motion_scale;
+				motion += sqrt(dx*dx + dy*dy)*vectors[i].w*vectors[i].h;
+				covered += (double)vectors[i].w*vectors[i].h;
+				if (vectors[i].source >= 0) past = false;
+			}
+			motion /= pixels;
+		}
+		// B frames and future references copy from a frame other than the one displayed before; the vectors don't name
+		// which past frame a P frame used, so the matcher still confirms these with a sampled check
+		still = (decoded->pict_type == AV_PICTURE_TYPE_P && side != NULL && past && covered >= pixels
+			&& motion == 0.0 && coded_bpp < STILL_BPP);
+		hinted = true;
+	}
+	int frameIndex() const {
+		int64_t pts = (decoded->best_effort_timestamp != AV_NOPTS_VALUE) ? decoded->best_effort_timestamp : decoded->pts;
+		return llround((pts - start_pts)*av_q2d(time_base)*fps);
+	}
+	// copies the decoded planes into one contiguous I420 Mat, converting only when the decoder used another layout
+	void repack(Mat& frame) {
+		frame.create(height*3/2,width,bits > 8 ? CV_16UC1 : CV_8UC1);
+		int sample = frame.elemSize();
+		uint8_t* planes[3] = {frame.data, frame.data + width*height*sample, frame.data + width*height*5/4*sample};
+		int strides[3] = {width*sample, width/2*sample, width/2*sample};
+		if (decoded->format == target || (target == AV_PIX_FMT_YUV420P && decoded->format == AV_PIX_FMT_YUVJ420P)) {
+			for (int p = 0; p < 3; p++) {
+				av_image_copy_plane(planes[p],strides[p],decoded->data[p],decoded->linesize[p],strides[p],p == 0 ? height : height/2);
+			}
+		} else {
+			scaler = sws_getCachedContext(scaler,decoded->width,decoded->height,(AVPixelFormat)decoded->format,
+				width,height,target,SWS_BILINEAR,NULL,NULL,NULL);
+			sws_scale(scaler,(const uint8_t* const*)decoded->data,decoded->linesize,0,decoded->height,planes,strides);
+		}
+	}
+};
+
+// Encodes I420 frames with libavcodec, so planar frames go straight to the encoder without a BGR round trip
+// keeps the input's codec when there's an encoder for it, otherwise uses the container's default
+// given an audio input, its audio streams are copied packet for packet into the same container
+class LibavSink : public Sink {
+public:
+	bool vfr = false; // encode each frame once, held for all its slots; cleared by open if the container has no timestamps
+	EncoderSettings settings;
+	bool fell_back = false; // the requested encoder couldn't be opened, so the input's codec or the container default was used
+	string ignored; // options the chosen encoder doesn't have
+	int audio_streams = 0;
+	long long audio_packets = 0;
+	~LibavSink() {
+		release();
+	}
+	// audio_start and audio_end are the range being processed in seconds of the input, audio_end 0 for the whole file
+	bool open(const string& name, const Source& source, double fps, const string& audio_input, double audio_start, double audio_end) {
+		if (avformat_alloc_output_context2(&format_ctx,NULL,NULL,name.c_str()) < 0 || format_ctx == NULL) return false;
+		const AVCodec* encoder = NULL;
+		if (!settings.name.empty()) {
+			encoder = avcodec_find_encoder_by_name(settings.name.c_str());
+			if (encoder == NULL || !tryOpen(encoder,source,fps)) {
+				encoder = NULL;
+				fell_back = true;
+			}
+		}
+		if (encoder == NULL) {
+			encoder = avcodec_find_encoder(inputCodec(source));
+			if (encoder == NULL || !tryOpen(encoder,source,fps)) {
+				encoder = avcodec_find_encoder(format_ctx->oformat->video_codec);
+				if (encoder == NULL || !tryOpen(encoder,source,fps)) return false;
+			}
+		}
+		stream = avformat_new_stream(format_ctx,NULL);
+		if (stream == NULL) return false;
+		avcodec_parameters_from_context(stream->codecpar,codec_ctx);
+		stream->time_base = codec_ctx->time_base;
+		frame_rate = fps;
+		if (format_ctx->oformat->flags & AVFMT_NOTIMESTAMPS) vfr = false;
+		if (!audio_input.empty() && !openAudio(audio_input,audio_start,audio_end)) {
+			closeAudio();
+			if (audio_failed) return false;
+		}
+		if (!(format_ctx->oformat->flags & AVFMT_NOFILE) && avio_open(&format_ctx->pb,name.c_str(),AVIO_FLAG_WRITE) < 0) return false;
+		if (avformat_write_header(format_ctx,NULL) < 0) return false;
+		header_written = true;
+		frame = av_frame_alloc();
+		packet = av_packet_alloc();
+		frame->format = codec_ctx->pix_fmt;
+		frame->width = source.width;
+		frame->height = source.height;
+		source_bits = source.bits;
+		codec = encoder->name;
+		return true;
+	}
+	void write(const Mat& in, int repeats) {
+		const Mat* out = &in;
+		if (in.channels() == 3) {
+			cvtColor(in,yuv,COLOR_BGR2YUV_I420);
+			out = &yuv;
+		} else if (in.depth() == CV_16U && bits == 8) {
+			in.convertTo(yuv,CV_8U,1.0/(1 << (source_bits - 8)));
+			out = &yuv;
+		}
+		// the frame borrows the Mat's planes; the encoder copies what it needs to keep
+		int w = frame->width, h = frame->height, sample = out->elemSize();
+		frame->data[0] = (uint8_t*)out->data;
+		frame->data[1] = (uint8_t*)out->data + w*h*sample;
+		frame->data[2] = (uint8_t*)out->data + w*h*5/4*sample;
+		frame->linesize[0] = w*sample;
+		frame->linesize[1] = w/2*sample;
+		frame->linesize[2] = w/2*sample;
+		if (vfr) {
+			// timestamps put the one copy on the same output grid as the repeats it replaces
+			frame->pts = next_pts;
+			durations[next_pts] = repeats;
+			next_pts += repeats;
+			encode(frame);
+		} else {
+			for (int i = 0; i < repeats; i++) {
+				frame->pts = next_pts++;
+				encode(frame);
+			}
+		}
+		// audio follows the slots written, which stay within adjustment_bound of the content's own time
+		copyAudio((int64_t)(next_pts*AV_TIME_BASE/frame_rate));
+	}
+	void release() {
+		if (codec_ctx != NULL && header_written) {
+			encode(NULL); // drain delayed packets
+			copyAudio(INT64_MAX); // the rest of the range, even if the video came up a little short
+			av_write_trailer(format_ctx);
+		}
+		closeAudio();
+		durations.clear();
+		header_written = false;
+		if (frame != NULL) av_frame_free(&frame);
+		if (packet != NULL) av_packet_free(&packet);
+		if (codec_ctx != NULL) avcodec_free_context(&codec_ctx);
+		if (format_ctx != NULL) {
+			if (!(format_ctx->oformat->flags & AVFMT_NOFILE)) avio_closep(&format_ctx->pb);
+			avformat_free_context(format_ctx);
+			format_ctx = NULL;
+		}
+	}
+	string codec;
+protected:
+	AVFormatContext* format_ctx = NULL;
+	AVCodecContext* codec_ctx = NULL;
+	AVStream* stream = NULL;
+	AVFrame* frame = NULL;
+	AVPacket* packet = NULL;
+	int64_t next_pts = 0;
+	double frame_rate = 0.0;
+	map<int64_t,int64_t> durations; // slots each frame in the encoder is held for by pts, in vfr mode
+	bool header_written = false;
+	AVFormatContext* audio_ctx = NULL; // a second demuxer on the input that only reads its audio
+	vector<int> audio_map; // output stream of each input stream, -1 for streams not copied
+	AVPacket* audio_packet = NULL;
+	bool audio_pending = false; // audio_packet was read but is past the video written so far
+	bool audio_failed = false; // output streams were added for the audio but copying into them failed
+	int64_t audio_start = 0, audio_end = INT64_MAX; // range in AV_TIME_BASE units from the start of the input's video
+	int64_t video_start = 0; // when the input's video starts, audio before it is dropped like in a -ss run
+	int bits = 8; // depth the encoder was opened with
+	int source_bits = 8;
+	Mat yuv;
+	// libavcodec id of the input's codec, from the decoder or looked up from the fourcc OpenCV reports
+	static AVCodecID inputCodec(const Source& source) {
+		if (source.codec_id != 0) return (AVCodecID)source.codec_id;
+		const AVCodecTag* tags[] = {avformat_get_riff_video_tags(), avformat_get_mov_video_tags(), NULL};
+		return av_codec_get_id(tags,source.fourcc);
+	}
+	// high bit depth sources try to keep their depth, encoders that only take 8-bit get the samples shifted down
+	bool tryOpen(const AVCodec* encoder, const Source& source, double fps) {
+		if (source.bits > 8) {
+			AVPixelFormat deep = (source.bits == 10) ? AV_PIX_FMT_YUV420P10LE : (source.bits == 12 ? AV_PIX_FMT_YUV420P12LE : AV_PIX_FMT_YUV420P16LE);
+			if (tryFormat(encoder,source,fps,deep)) {
+				bits = source.bits;
+				return true;
+			}
+		}
+		bits = 8;
+		return tryFormat(encoder,source,fps,AV_PIX_FMT_YUV420P);
+	}
+	bool tryFormat(const AVCodec* encoder, const Source& source, double fps, AVPixelFormat format) {
+		if (codec_ctx != NULL) avcodec_free_context(&codec_ctx);
+		codec_ctx = avcodec_alloc_context3(encoder);
+		int num, den;
+		rationalFps(fps,num,den);
+		codec_ctx->width = source.width;
+		codec_ctx->height = source.height;
+		codec_ctx->pix_fmt = format;
+		codec_ctx->time_base = av_make_q(den,num);
+		codec_ctx->framerate = av_make_q(num,den);
+		if (format_ctx->oformat->flags & AVFMT_GLOBALHEADER) codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+		codec_ctx->thread_count = settings.threads; // libavcodec would otherwise run many encoders on one thread
+		if (settings.bitrate > 0) codec_ctx->bit_rate = settings.bitrate*1000;
+		// preset and crf are private options, an encoder without them leaves them in the dictionary
+		AVDictionary* options = NULL;
+		if (!settings.preset.empty()) av_dict_set(&options,"preset",settings.preset.c_str(),0);
+		if (settings.crf >= 0) av_dict_set(&options,"crf",cv::format("%g",settings.crf).c_str(),0);
+		bool opened = avcodec_open2(codec_ctx,encoder,&options) >= 0;
+		ignored.clear();
+		AVDictionaryEntry* entry = NULL;
+		while ((entry = av_dict_get(options,"",entry,AV_DICT_IGNORE_SUFFIX)) != NULL) {
+			ignored += (ignored.empty() ? "" : ", ") + string(entry->key);
+		}
+		av_dict_free(&options);
+		return opened;
+	}
+	// adds an output stream for each audio stream the container can hold, before the header is written
+	bool openAudio(const string& input, double start, double end) {
+		if (avformat_open_input(&audio_ctx,input.c_str(),NULL,NULL) < 0) return false;
+		if (avformat_find_stream_info(audio_ctx,NULL) < 0) return false;
+		audio_map.assign(audio_ctx->nb_streams,-1);
+		// pick every stream first, so nothing is added to the output unless there's something to copy
+		vector<unsigned> copied;
+		for (unsigned i = 0; i < audio_ctx->nb_streams; i++) {
+			AVStream* in = audio_ctx->streams[i];
+			if (in->codecpar->codec_type != AVMEDIA_TYPE_AUDIO || avformat_query_codec(format_ctx->oformat,in->codecpar->codec_id,FF_COMPLIANCE_NORMAL) == 0) {
+				in->discard = AVDISCARD_ALL;
+				continue;
+			}
+			copied.push_back(i);
+		}
+		if (copied.empty()) return false;
+		for (size_t c = 0; c < copied.size(); c++) {
+			AVStream* in = audio_ctx->streams[copied[c]];
+			AVStream* out = avformat_new_stream(format_ctx,NULL);
+			if (out == NULL || avcodec_parameters_copy(out->codecpar,in->codecpar) < 0) {
+				audio_failed = true; // streams already added would go into the header empty, so the whole open fails
+				return false;
+			}
+			out->codecpar->codec_tag = 0; // let the output container pick its own tag
+			out->time_base = in->time_base;
+			audio_map[copied[c]] = out->index;
+			audio_streams++;
+		}
+		// timestamps are measured from the video's first frame, which is where the output's video starts too
+		int video = av_find_best_stream(audio_ctx,AVMEDIA_TYPE_VIDEO,-1,-1,NULL,0);
+		if (video >= 0 && audio_ctx->streams[video]->start_time != AV_NOPTS_VALUE) {
+			video_start = av_rescale_q(audio_ctx->streams[video]->start_time,audio_ctx->streams[video]->time_base,av_get_time_base_q());
+		} else if (audio_ctx->start_time != AV_NOPTS_VALUE) {
+			video_start = audio_ctx->start_time;
+		}
+		audio_start = llround(start*AV_TIME_BASE);
+		audio_end = (end > 0) ? llround(end*AV_TIME_BASE) : INT64_MAX;
+		if (audio_start > 0) av_seek_frame(audio_ctx,-1,video_start + audio_start,AVSEEK_FLAG_BACKWARD);
+		audio_packet = av_packet_alloc();
+		if (audio_packet == NULL) audio_failed = true;
+		return !audio_failed;
+	}
+	// copies audio up to the given output time in AV_TIME_BASE units, so the muxer only has to interleave a frame's worth
+	void copyAudio(int64_t until) {
+		while (audio_ctx != NULL) {
+			if (!audio_pending) {
+				if (av_read_frame(audio_ctx,audio_packet) < 0) {
+					closeAudio(); // all of it is out
+					return;
+				}
+				// streams can appear mid-file in formats without a header, e.g. MPEG-TS, and are never copied
+				if (audio_packet->stream_index >= (int)audio_map.size() || audio_map[audio_packet->stream_index] < 0) {
+					av_packet_unref(audio_packet);
+					continue;
+				}
+				audio_pending = true;
+			}
+			AVStream* in = audio_ctx->streams[audio_packet->stream_index];
+			int64_t pts = (audio_packet->pts != AV_NOPTS_VALUE) ? audio_packet->pts : audio_packet->dts;
+			int64_t time = av_rescale_q(pts,in->time_base,av_get_time_base_q()) - video_start; // from the start of the input
+			if (time >= audio_end) {
+				closeAudio(); // past the range
+				return;
+			}
+			if (time - audio_start >= until) return; // wait for the video to catch up
+			audio_pending = false;
+			if (time < audio_start) { // before the range, from seeking back to a packet boundary
+				av_packet_unref(audio_packet);
+				continue;
+			}
+			// shift onto the output's timeline, which starts at zero with the first written frame
+			int64_t offset = av_rescale_q(video_start + audio_start,av_get_time_base_q(),in->time_base);
+			if (audio_packet->pts != AV_NOPTS_VALUE) audio_packet->pts -= offset;
+			if (audio_packet->dts != AV_NOPTS_VALUE) audio_packet->dts -= offset;
+			AVStream* out = format_ctx->streams[audio_map[audio_packet->stream_index]];
+			av_packet_rescale_ts(audio_packet,in->time_base,out->time_base);
+			audio_packet->stream_index = out->index;
+			audio_packet->pos = -1;
+			av_interleaved_write_frame(format_ctx,audio_packet); // takes the packet's data and leaves it blank
+			audio_packets++;
+		}
+	}
+	void closeAudio() {
+		if (audio_packet != NULL) av_packet_free(&audio_packet);
+		if (audio_ctx != NULL) avformat_close_input(&audio_ctx);
+		audio_pending = false;
+	}
+	void encode(AVFrame* input) {
+		avcodec_send_frame(codec_ctx,input);
+		while (avcodec_receive_packet(codec_ctx,packet) == 0) {
+			// packets may come out reordered, so durations are looked up rather than taken in order
+			map<int64_t,int64_t>::iterator duration = durations.find(packet->pts);
+			if (duration != durations.end()) {
+				packet->duration = duration->second;
+				durations.erase(duration);
+			}
+			av_packet_rescale_ts(packet,codec_ctx->time_base,stream->time_base);
+			packet->stream_index = stream->index;
+			av_interleaved_write_frame(format_ctx,packet);
+		}
+	}
+};
+#endif
+
+// One file being written, with its own rate, encoder and encode thread, all fed from the same allocation
+// every output sees the same frames over the same slots and only differs in which slots it encodes
+class Output {
+public:
+	string name;
+	double target_fps = 0.0; // output rate when downsampling in the same pass, 0 writes at input fps
+	EncoderSettings encoder;
+	bool vfr = false; // write each frame once with a duration instead of repeating it (libav builds)
+	Sink* sink = NULL;
+	Cadence slot_step; // input slots per output frame, e.g. 2 for 60 -> 30 or 5/2 for 60 -> 24
+	long long next_slot = 0; // next input slot the output samples
+	long long base = 0; // output frames before the start of the range, keeps slot picks in phase with a full run
+	int index = 0; // frames actually encoded
+	SpscRing<EncodeJob>* queue = NULL; // frames waiting for this output's encode thread, one of ENCODE_QUEUES
+	// output frames a run of slots is encoded as
+	// when downsampling, only the slots picked by the target rate are encoded;
+	// picking the first slot at or after each output time means every frame holding its full count is kept
+	int take(long long slot, int slots) {
+		int repeats = 0;
+		for (long long s = slot; s < slot + slots; s++) {
+			if (s >= next_slot) {
+				repeats++; index++;
+				next_slot = slot_step.pick(base + index);
+			}
+		}
+		return repeats;
+	}
+};
+
+// Global definitions, using globals for speed
+Source* SOURCE = NULL;
+int RAW_WIDTH = 0, RAW_HEIGHT = 0; // headerless .yuv input has to be described on the command line
+double RAW_FPS = 0.0;
+int RAW_BITS = 8;
+bool CODEC_HINTS = false; // take priority and a duplicate prefilter from decoder statistics (libav builds)
+long long PREFILTERED = 0; // frames the codec statistics found as duplicates, confirmed by a sampled check only
+bool HINT_PRIORITY = false; // rank frames by coded size, until a frame arrives without it
+bool NATIVE_YUV = false; // keep frames in I420 from decode to encode, needs a libav build for formats other than y4m/yuv
+bool COPY_AUDIO = false; // copy the input's audio streams into the output (libav builds)
+vector<Output*> OUTPUTS; // the output named on the command line first, then any added with -output
+double FPS; // actually should be double because even at 60 fps, video could be fractional (e.g. 59.96 fps)
+Threshold THRESH; // starts on strict
+int WRITE_INDEX = 0; // global index counter to track progress
+int COMP_WIDTH;
+int COMP_HEIGHT;
+chrono::time_point<chrono::system_clock> START;
+chrono::time_point<chrono::system_clock> RUNNING;
+double LAST_FPS = 0.0, LAST_SPEED = 0.0; // not a true moving average, but average reporting with last to keep some form of stability
+int LAST_INDEX = 0; // additional index tracking for reading and reporting
+int READ_INDEX = -1; // starts at -1 since 0-based (first frame is actually 0)
+int TOTAL_LENGTH;
+int START_INDEX = 0; // first frame of the requested range
+int END_INDEX = INT_MAX; // one past the last frame of the requested range
+atomic<bool> FINISHED{false};
+atomic<bool> STOPPED{false}; // ctrl-c, the decode stage ends early and what was read so far is written
+int DRIFT = 0; // used to manage adjustment bounds
+Cadence CADENCE; // slots each content frame needs, set from duplicate_count
+CadenceTracker TRACKER; // skips full comparisons for predicted duplicates when enabled
+NoiseTracker NOISE; // raises thresholds over noisy stretches when enabled
+SceneCuts SCENES; // splits buffer allocation at hard cuts when enabled
+Calibrator CALIBRATOR; // fits thresholds to the measured noise floor when enabled
+const int SAMPLE_STRIDE = 4; // pixel spacing of the cheap check that confirms a predicted duplicate
+bool AREA_FILTER = true; // box-filter the comparison images, nearest neighbour just picks one pixel per block
+bool COMPARE_CHROMA = false; // include subsampled U and V in the comparison image
+int PYRAMID_SCALE = 0; // extra reduction of the coarse comparison level, 0 compares at comparison_scale only
+const double PYRAMID_BAND = 2.0; // coarse stdevs within this factor of the threshold are checked at the finer level
+atomic<long long> PYRAMID_DECIDED{0}, PYRAMID_DESCENDED{0}; // probe workers compare in parallel too
+const int PYRAMID_CHECK = 8; // one coarse decision in this many is measured at the finer level as well
+double PYRAMID_RATIO[2] = {0.0, 0.0}; // log of fine over coarse stdev for clear duplicates and for clear changes
+int PYRAMID_CHECKED[2] = {0, 0}; // comparisons each ratio has been measured from
+int PYRAMID_SINCE[2] = {0, 0}; // coarse decisions on each side since the last one measured at both levels
+double SAMPLE_BUDGET = 0.0; // share of rows a sampled comparison may visit before finishing the full scan, 0 always scans
+atomic<long long> SAMPLED_ROWS{0}, SAMPLED_EARLY{0}, SAMPLED_COMPARISONS{0};
+atomic<long long> SAMPLED_TOTAL_ROWS{0}; // rows the sampled comparisons could have visited, the full scans they replaced
+double COMP_UNIT = 1.0; // comparison image steps per 8-bit step, e.g. 4 for 10-bit sources, keeps thresholds in 8-bit units
+// decode, match/allocate and encode run as separate stages passing handles into the frame pool
+vector<PooledFrame> FRAME_POOL;
+SpscRing<int> DECODED_QUEUE; // decode -> match, frames with their comparison images ready
+SpscRing<int> FREE_QUEUE; // last encode -> decode, handles ready for the next read
+// match -> encode runs through each output's queue in turn, so every ring keeps one producer and one consumer
+// the rings are static because new doesn't honour their cache line alignment before C++17
+const int MAX_OUTPUTS = 8;
+SpscRing<EncodeJob> ENCODE_QUEUES[MAX_OUTPUTS];
+int ENCODE_STAGES = 0; // rings in use this run, for the reporter
+const int QUEUE_DEPTH = 8; // frames a stage may run ahead of the next one
+const int DECODE_STAGE = 0, MATCH_STAGE = 1, ENCODE_STAGE = 2; // order stages take CPUs from -cpus
+vector<int> CPU_LIST; // pin each stage or probe worker to one of these in turn, empty for no per-thread pinning
+int NUMA_NODE = -1; // keep every thread on this node's CPUs, -1 for anywhere
+bool HUGE_PAGES = false; // back the frame pool with one mapping on huge pages instead of a heap block per image
+unsigned char* POOL_MEMORY = NULL;
+size_t POOL_BYTES = 0;
+string POOL_BACKING; // what the mapping ended up on, kept with it
+vector<int> POOL_CPUS; // where the decode stage that faulted the mapping in was placed, empty for unpinned
+bool SERVING = false; // running jobs from -serve, which keeps the pool mapping from one job to the next
+const int JOB_TIMEOUT = 30; // seconds -serve waits on a client that has stopped sending or reading
+
+// Catching ctrl-c allows program to stop and write current progress
+// the stages are still reading and writing, so this only tells them to wind down and the run finishes its output
+// the usual way; a second ctrl-c quits at once
+void signal_handler(int s) {
+	STOPPED = true;
+	FINISHED = true;
+	signal(s,SIG_DFL);
+}
+
+// Sum and sum of squares of the absolute difference of two rows, fused so no difference image is written and read back
+// SSE2 handles 16 (8-bit) or 8 (16-bit) samples per step, the scalar loop finishes the row and covers other targets
+void diffRow(const uchar* a, const uchar* b, int n, uint64_t& sum, uint64_t& sumsq) {
+	int x = 0;
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128(), acc_sum = zero, acc_sq = zero;
+	for (; x + 16 <= n; x += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + x));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(b + x));
+		__m128i d = _mm_or_si128(_mm_subs_epu8(va,vb),_mm_subs_epu8(vb,va));
+		acc_sum = _mm_add_epi64(acc_sum,_mm_sad_epu8(d,zero));
+		__m128i lo = _mm_unpacklo_epi8(d,zero), hi = _mm_unpackhi_epi8(d,zero);
+		__m128i sq = _mm_add_epi32(_mm_madd_epi16(lo,lo),_mm_madd_epi16(hi,hi)); // at most 4*255^2 per lane
+		acc_sq = _mm_add_epi64(acc_sq,_mm_add_epi64(_mm_unpacklo_epi32(sq,zero),_mm_unpackhi_epi32(sq,zero)));
+	}
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i*)lanes,acc_sum);
+	sum += lanes[0] + lanes[1];
+	_mm_storeu_si128((__m128i*)lanes,acc_sq);
+	sumsq += lanes[0] + lanes[1];
+#endif
+	for (; x < n; x++) {
+		unsigned d = abs(a[x] - b[x]);
+		sum += d;
+		sumsq += d*d;
+	}
+}
+
+void diffRow(const ushort* a, const ushort* b, int n, uint64_t& sum, uint64_t& sumsq) {
+	int x = 0;
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128(), acc_sum = zero, acc_sq = zero;
+	for (; x + 8 <= n; x += 8) {
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + x));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(b + x));
+		__m128i d = _mm_or_si128(_mm_subs_epu16(va,vb),_mm_subs_epu16(vb,va));
+		__m128i lo = _mm_unpacklo_epi16(d,zero), hi = _mm_unpackhi_epi16(d,zero);
+		__m128i s = _mm_add_epi32(lo,hi);
+		acc_sum = _mm_add_epi64(acc_sum,_mm_add_epi64(_mm_unpacklo_epi32(s,zero),_mm_unpackhi_epi32(s,zero)));
+		// full 16-bit differences overflow the signed multiply-add, so square even and odd lanes into 64 bits
+		acc_sq = _mm_add_epi64(acc_sq,_mm_mul_epu32(lo,lo));
+		acc_sq = _mm_add_epi64(acc_sq,_mm_mul_epu32(_mm_srli_epi64(lo,32),_mm_srli_epi64(lo,32)));
+		acc_sq = _mm_add_epi64(acc_sq,_mm_mul_epu32(hi,hi));
+		acc_sq = _mm_add_epi64(acc_sq,_mm_mul_epu32(_mm_srli_epi64(hi,32),_mm_srli_epi64(hi,32)));
+	}
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i*)lanes,acc_sum);
+	sum += lanes[0] + lanes[1];
+	_mm_storeu_si128((__m128i*)lanes,acc_sq);
+	sumsq += lanes[0] + lanes[1];
+#endif
+	for (; x < n; x++) {
+		uint64_t d = abs(a[x] - b[x]);
+		sum += d;
+		sumsq += d*d;
+	}
+}
+
+// Standard deviation of the absolute difference of two comparison images, in 8-bit units whatever their depth
+double diffStdev(const Mat& a, const Mat& b) {
+	uint64_t sum = 0, sumsq = 0;
+	for (int y = 0; y < a.rows; y++) {
+		if (a.depth() == CV_16U) diffRow(a.ptr<ushort>(y),b.ptr<ushort>(y),a.cols,sum,sumsq);
+		else diffRow(a.ptr<uchar>(y),b.ptr<uchar>(y),a.cols,sum,sumsq);
+	}
+	double n = (double)a.rows*a.cols;
+	double mean = sum/n;
+	return sqrt(max(0.0, sumsq/n - mean*mean))/COMP_UNIT;
+}
+
+// Rows of an image in van der Corput order (bit-reversed counting), so any prefix is spread evenly over the whole frame
+// kept per thread, since probe workers compare at several heights at once
+const vector<int>& rowOrder(int rows) {
+	static thread_local vector<int> order;
+	if ((int)order.size() == rows) return order;
+	order.clear();
+	int bits = 0;
+	while ((1 << bits) < rows) bits++;
+	for (int i = 0; i < (1 << bits); i++) {
+		int r = 0;
+		for (int bit = 0; bit < bits; bit++) {
+			if (i & (1 << bit)) r |= 1 << (bits - 1 - bit);
+		}
+		if (r < rows) order.push_back(r);
+	}
+	return order;
+}
+
+// Sampled standard deviation: visits rows in van der Corput order and stops once a confidence interval
+// on the stdev lies entirely on one side of the threshold; after SAMPLE_BUDGET of the rows it just finishes the scan
+// the interval treats rows as the samples (delta method on the per-row moments) since neighbouring pixels are correlated
+double sampledStdev(const Mat& a, const Mat& b) {
+	const vector<int>& order = rowOrder(a.rows);
+	SAMPLED_TOTAL_ROWS += a.rows;
+	const double Z = 3.0; // about 99.7% two-sided, a wrong early call costs a lost or doubled frame
+	const int MIN_ROWS = 16, CHECK_EVERY = 8;
+	uint64_t sum = 0, sumsq = 0;
+	double m1_sum = 0.0, m2_sum = 0.0, m1_sq = 0.0, m2_sq = 0.0, m12 = 0.0;
+	int budget = (int)(SAMPLE_BUDGET*a.rows);
+	double n = a.cols;
+	for (size_t i = 0; i < order.size(); i++) {
+		uint64_t row_sum = 0, row_sumsq = 0;
+		int y = order[i];
+		if (a.depth() == CV_16U) diffRow(a.ptr<ushort>(y),b.ptr<ushort>(y),a.cols,row_sum,row_sumsq);
+		else diffRow(a.ptr<uchar>(y),b.ptr<uchar>(y),a.cols,row_sum,row_sumsq);
+		sum += row_sum;
+		sumsq += row_sumsq;
+		int k = i + 1;
+		if (k >= budget) continue; // out of budget, the rest of the rows make it an exact full scan
+		double m1 = row_sum/n, m2 = row_sumsq/n;
+		m1_sum += m1; m2_sum += m2;
+		m1_sq += m1*m1; m2_sq += m2*m2; m12 += m1*m2;
+		if (k < MIN_ROWS || k % CHECK_EVERY != 0) continue;
+		double mean1 = m1_sum/k, mean2 = m2_sum/k;
+		double variance = max(0.0,mean2 - mean1*mean1);
+		// per-row influence on the variance is m2 - 2*mean1*m1, its spread over the rows gives the standard error
+		double spread = (m2_sq/k - mean2*mean2) - 4*mean1*(m12/k - mean1*mean2) + 4*mean1*mean1*(m1_sq/k - mean1*mean1);
+		double error = Z*sqrt(max(0.0,spread)/k);
+		double threshold = THRESH.value*COMP_UNIT;
+		if (sqrt(variance + error) < threshold || sqrt(max(0.0,variance - error)) > threshold) {
+			SAMPLED_ROWS += k;
+			SAMPLED_EARLY++;
+			return sqrt(variance)/COMP_UNIT;
+		}
+	}
+	SAMPLED_ROWS += a.rows;
+	double total = (double)a.rows*a.cols;
+	double mean = sum/total;
+	return sqrt(max(0.0, sumsq/total - mean*mean))/COMP_UNIT;
+}
+
+// Frame matching algorithm, rely on standard deviation at the moment, although a variety of methods
+bool matchFrames(const Mat& a, const Mat& b, double& stdev) {
+	// Primary method for frame comparison
+	// Standard deviation of the absolute difference is an excellent measure of the intensity of differences between the frames
+	// Save standard deviation to stdev for caller to use to determine frame similarity
+	if (SAMPLE_BUDGET > 0) SAMPLED_COMPARISONS++;
+	stdev = (SAMPLE_BUDGET > 0) ? sampledStdev(a,b) : diffStdev(a,b);
+	// Return bool representing decision of match (true if they match, false if not a match)
+	if (stdev < THRESH.value) {
+		return true;
+	} else {
+		return false;
+	}
+}
+
+// Coarse-to-fine matching: the coarse level decides on its own unless its stdev lands within PYRAMID_BAND of the threshold,
+// so clear duplicates and clear changes cost a fraction of a full comparison and only borderline frames pay for the finer level
+// a coarse decision reports its stdev scaled to the finer level, so priority, scene cuts, noise tracking and calibration
+// all see one measure; averaging shrinks noise far more than real change, so duplicates and changes each keep their own
+// ratio, refreshed by measuring one clear decision in PYRAMID_CHECK on that side at both levels
+bool matchFrames(const Mat& a, const Mat& b, const Mat& coarse_a, const Mat& coarse_b, double& stdev) {
+	if (coarse_a.empty() || coarse_b.empty()) return matchFrames(a,b,stdev);
+	double coarse = diffStdev(coarse_a,coarse_b);
+	bool clear = (coarse < THRESH.value/PYRAMID_BAND || coarse > THRESH.value*PYRAMID_BAND);
+	int side = (coarse > THRESH.value);
+	if (clear && PYRAMID_CHECKED[side] > 0 && ++PYRAMID_SINCE[side] < PYRAMID_CHECK) {
+		PYRAMID_DECIDED++;
+		stdev = coarse*exp(PYRAMID_RATIO[side]);
+		return coarse < THRESH.value;
+	}
+	PYRAMID_DESCENDED++;
+	bool match = matchFrames(a,b,stdev);
+	if (clear) {
+		if (coarse > 0 && stdev > 0) {
+			double ratio = log(stdev/coarse);
+			PYRAMID_RATIO[side] = (PYRAMID_CHECKED[side] == 0) ? ratio : PYRAMID_RATIO[side] + 0.1*(ratio - PYRAMID_RATIO[side]);
+		}
+		PYRAMID_CHECKED[side]++;
+		PYRAMID_SINCE[side] = 0;
+	}
+	return match;
+}
+
+// Cheap confirmation for a predicted duplicate, same standard deviation measure but over a jittered grid of pixels
+// touches 1/(SAMPLE_STRIDE^2) of the comparison image, one pixel in every block, with the column shifting from one
+// sampled row to the next so thin vertical detail can't fall between samples
+// each sampled row must also pass on its own, since a cursor or a subtitle hardly moves the figure for the whole grid;
+// refusing only costs the full comparison, so it errs that way
+template <typename T>
+bool sampleGrid(const Mat& a, const Mat& b) {
+	const double threshold = THRESH.value*COMP_UNIT;
+	double sum = 0.0, sumsq = 0.0;
+	int n = 0;
+	for (int y = SAMPLE_STRIDE/2, row = 0; y < a.rows; y += SAMPLE_STRIDE, row++) {
+		const T* pa = a.ptr<T>(y);
+		const T* pb = b.ptr<T>(y);
+		double row_sum = 0.0, row_sumsq = 0.0;
+		int row_n = 0;
+		for (int x = (3*row + 1) % SAMPLE_STRIDE; x < a.cols; x += SAMPLE_STRIDE) {
+			double d = abs(pa[x] - pb[x]);
+			row_sum += d;
+			row_sumsq += d*d;
+			row_n++;
+		}
+		if (row_n == 0) continue;
+		double row_mean = row_sum/row_n;
+		if (sqrt(max(0.0, row_sumsq/row_n - row_mean*row_mean)) >= threshold) return false; // a local change
+		sum += row_sum;
+		sumsq += row_sumsq;
+		n += row_n;
+	}
+	if (n == 0) return false; // image too small to sample, always fall back to a full comparison
+	double mean = sum/n;
+	return sqrt(max(0.0, sumsq/n - mean*mean))/COMP_UNIT < THRESH.value;
+}
+
+bool sampleFrames(const Mat& a, const Mat& b) {
+	return (a.depth() == CV_16U) ? sampleGrid<ushort>(a,b) : sampleGrid<uchar>(a,b);
+}
+
+void Calibrator::add(double stdev) {
+	if (interval <= 0) return;
+	samples.push_back(stdev);
+	if (samples.size() >= (size_t)interval) {
+		if (fit(samples)) {
+			cout << "recalibrated threshold_strict=" << THRESH.strict << ", threshold_relaxed=" << THRESH.relaxed << endl;
+		}
+		samples.clear();
+	}
+}
+
+bool Calibrator::fit(const vector<double>& stdevs) {
+	double strict;
+	if (!fitThreshold(stdevs,strict,separation)) return false;
+	THRESH.update(strict,strict*THRESH.relaxed/THRESH.strict);
+	NOISE.rebase();
+	return true;
+}
+
+void NoiseTracker::rebase() {
+	base_strict = THRESH.strict;
+	base_relaxed = THRESH.relaxed;
+}
+
+void NoiseTracker::add(double stdev) {
+	if (margin <= 0) return;
+	double value = log(stdev + 0.001);
+	if (seen == 0) log_floor = log_ceiling = value;
+	// stochastic quantile steps: settle where the share of values below is LOW (or HIGH)
+	log_floor += RATE*((value > log_floor) ? LOW : LOW - 1);
+	log_ceiling += RATE*((value > log_ceiling) ? HIGH : HIGH - 1);
+	floor = exp(log_floor);
+	ceiling = exp(log_ceiling);
+	if (++seen < WARMUP) return;
+	double target = base_strict;
+	if (ceiling > 2*margin*floor) { // clearly two clusters, so the low quantile is the noise and not content
+		// margin above the noise, but never past the geometric middle between noise and changes
+		target = max(base_strict,min(margin*floor,sqrt(floor*ceiling)));
+	}
+	// only move once the target has left the deadband around the current threshold
+	if (fabs(target - THRESH.strict) > DEADBAND*THRESH.strict) {
+		THRESH.update(target,target*base_relaxed/base_strict);
+		adjustments++;
+		highest = max(highest,target);
+	}
+}
+
+// Otsu split of a set of stdevs, shared by calibration and probing
+// separation is the share of log-stdev variance explained by the split, 1 is perfectly bimodal
+bool fitThreshold(const vector<double>& stdevs, double& threshold, double& separation) {
+	separation = 0.0;
+	if (stdevs.size() < 2) return false;
+	const int BINS = 128;
+	// histogram of log10(stdev), identical frames land in the first bin instead of -inf
+	const double lo = -3.0, hi = 3.0;
+	vector<double> hist(BINS,0.0);
+	for (size_t i = 0; i < stdevs.size(); i++) {
+		int bin = (int)((log10(stdevs[i] + 0.001) - lo)/(hi - lo)*BINS);
+		hist[min(BINS - 1,max(0,bin))]++;
+	}
+	// Otsu: choose the split maximizing between-class variance
+	double total = stdevs.size(), sum_all = 0.0, sumsq_all = 0.0;
+	for (int b = 0; b < BINS; b++) {
+		sum_all += b*hist[b];
+		sumsq_all += (double)b*b*hist[b];
+	}
+	// empty bins between the modes all score the same, so track the whole tie and split in the middle of the gap
+	double weight_low = 0.0, sum_low = 0.0, best = 0.0;
+	int split = -1, split_end = -1;
+	for (int b = 0; b < BINS - 1; b++) {
+		weight_low += hist[b];
+		sum_low += b*hist[b];
+		double weight_high = total - weight_low;
+		if (weight_low == 0 || weight_high == 0) continue;
+		double diff = sum_low/weight_low - (sum_all - sum_low)/weight_high;
+		double between = weight_low*weight_high*diff*diff/(total*total);
+		if (between > best*(1 + 1e-9)) {
+			best = between;
+			split = b;
+			split_end = b;
+		} else if (between >= best*(1 - 1e-9) && split_end == b - 1) {
+			split_end = b;
+		}
+	}
+	double mean_all = sum_all/total;
+	double variance = sumsq_all/total - mean_all*mean_all;
+	separation = (variance > 0) ? best/variance : 0.0;
+	// a single mode (no duplicates, or all duplicates) still splits at about 0.64, so require clearly more
+	if (split < 0 || separation < 0.75) return false;
+	threshold = pow(10.0,lo + (0.5*(split + split_end) + 1)*(hi - lo)/BINS) - 0.001;
+	return true;
+}
+
+// Writes a certain frame over a specified number of slots, increments global index counter
+// WRITE_INDEX always counts slots at the input fps so drift is measured the same way for every output rate
+// the frame is queued for the encode stages, each writing the slots its rate keeps, and the last one frees its handle
+void writeFrames(int handle, int& count) {
+	EncodeJob job = {handle,WRITE_INDEX,count};
+	OUTPUTS[0]->queue->push(job);
+	WRITE_INDEX += count;
+	count = 0;
+}
+
+// Reads an extra output as <name>[:key=value...], e.g. out30.mp4:target_fps=30:encoder=libx264:crf=20
+// keys take the same values as the options of the same name, which only apply to the first output
+Output* parseOutput(const string& spec) {
+	stringstream fields(spec);
+	string field;
+	getline(fields,field,':');
+	if (field.empty()) {
+		cout << "output needs a file name, skipping " << spec << endl;
+		return NULL;
+	}
+	Output* out = new Output();
+	out->name = field;
+	while (getline(fields,field,':')) {
+		size_t equals = field.find('=');
+		string key = field.substr(0,equals);
+		string value = (equals == string::npos) ? string() : field.substr(equals + 1);
+		double val = atof(value.c_str());
+		if (key == "encoder") out->encoder.name = value;
+		else if (key == "preset") out->encoder.preset = value;
+		else if (key == "vfr") out->vfr = (equals == string::npos || val >= 1);
+		else if (key == "crf" && sscanf(value.c_str(),"%lf",&val) == 1 && val >= 0) out->encoder.crf = val;
+		else if (val <= 0) cout << "output option " << field << " of " << out->name << " is invalid, ignoring" << endl;
+		else if (key == "target_fps") out->target_fps = val;
+		else if (key == "encoder_threads") out->encoder.threads = (int)val;
+		else if (key == "bitrate") out->encoder.bitrate = val;
+		else cout << "unknown output option " << key << " for " << out->name << ", ignoring" << endl;
+	}
+	return out;
+}
+
+// Expands a Linux cpulist like "0-3,8,10-11" into CPU numbers, empty if it doesn't parse
+vector<int> parseCpuList(const string& list) {
+	vector<int> cpus;
+	stringstream ranges(list);
+	string range;
+	while (getline(ranges,range,',')) {
+		int first = -1, last = -1;
+		int fields = sscanf(range.c_str(),"%d-%d",&first,&last);
+		if (fields < 1 || first < 0 || (fields == 2 && last < first)) return vector<int>();
+		if (fields == 1) last = first;
+		for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+	}
+	return cpus;
+}
+
+// CPUs of a NUMA node as sysfs lists them, empty if there's no such node or it only has memory
+vector<int> nodeCpus(int node) {
+	ifstream file(cv::format("/sys/devices/system/node/node%d/cpulist",node).c_str());
+	string list;
+	getline(file,list);
+	return parseCpuList(list);
+}
+
+// CPUs the n-th thread may run on, numbered by stage or by probe worker; empty leaves it to the scheduler
+vector<int> threadCpus(int n) {
+	if (!CPU_LIST.empty()) return vector<int>(1,CPU_LIST[n % CPU_LIST.size()]);
+	if (NUMA_NODE >= 0) return nodeCpus(NUMA_NODE);
+	return vector<int>();
+}
+
+// Restricts the calling thread to a set of CPUs, false if the kernel refused
+bool pinThread(const vector<int>& cpus) {
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (size_t i = 0; i < cpus.size(); i++) {
+		if (cpus[i] < CPU_SETSIZE) CPU_SET(cpus[i],&set);
+	}
+	return pthread_setaffinity_np(pthread_self(),sizeof(set),&set) == 0;
+#else
+	return true;
+#endif
+}
+
+// Pins the calling thread to its CPUs
+// the kernel places memory on the node of the thread that first touches it, so a pinned stage's frames stay local
+void placeThread(int n) {
+	vector<int> cpus = threadCpus(n);
+	if (!cpus.empty() && !pinThread(cpus)) {
+		cout << "Unable to pin thread " << n << ", leaving it to the scheduler" << endl;
+	}
+}
+
+// Starts OpenCV's worker threads, they are created on first use and keep the affinity of the thread that asked
+class WakePool : public ParallelLoopBody {
+public:
+	void operator()(const Range&) const {}
+};
+
+// Keeps the calling thread on every CPU the run may use, all of -cpus or -numa_node's node
+// codec and OpenCV worker threads inherit the mask of the thread that starts them, so the main thread opens the
+// source and sinks and wakes OpenCV's pool from here, and only pins itself to the match stage's CPU afterwards
+void placeWorkers() {
+	vector<int> cpus = CPU_LIST.empty() ? threadCpus(MATCH_STAGE) : CPU_LIST;
+	if (cpus.empty()) return;
+	if (!pinThread(cpus)) cout << "Unable to keep codec threads on the chosen cpus, leaving them to the scheduler" << endl;
+	parallel_for_(Range(0,max(1,getNumThreads())),WakePool());
+}
+
+// Reports the NUMA nodes with their CPUs and how threads will be placed on them
+void printTopology() {
+	cout << "Topology: ";
+	int nodes = 0;
+	for (int node = 0; ; node++) {
+		ifstream file(cv::format("/sys/devices/system/node/node%d/cpulist",node).c_str());
+		if (!file) break;
+		string list;
+		getline(file,list);
+		cout << (nodes > 0 ? ", " : "") << "node" << node << " cpus " << (list.empty() ? "none" : list);
+		nodes++;
+	}
+	if (nodes == 0) cout << thread::hardware_concurrency() << " cpus, no NUMA information";
+	if (!CPU_LIST.empty()) {
+		cout << "; threads pinned in turn to cpus ";
+		for (size_t i = 0; i < CPU_LIST.size(); i++) cout << (i > 0 ? "," : "") << CPU_LIST[i];
+	} else if (NUMA_NODE >= 0) {
+		cout << "; threads kept on node" << NUMA_NODE;
+	} else {
+		cout << "; threads unpinned";
+	}
+	cout << endl;
+}
+
+// Case-insensitive check of a file name's extension
+bool hasExtension(const string& name, const string& extension) {
+	if (name.size() < extension.size()) return false;
+	for (size_t i = 0; i < extension.size(); i++) {
+		if (tolower(name[name.size() - extension.size() + i]) != extension[i]) return false;
+	}
+	return true;
+}
+
+// Adds a row of samples into per-column sums, the vertical half of the box filter
+void addRow(const uchar* row, uint32_t* acc, int n) {
+	int x = 0;
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128();
+	for (; x + 16 <= n; x += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(row + x));
+		__m128i lo = _mm_unpacklo_epi8(v,zero), hi = _mm_unpackhi_epi8(v,zero);
+		__m128i* out = (__m128i*)(acc + x);
+		_mm_storeu_si128(out,_mm_add_epi32(_mm_loadu_si128(out),_mm_unpacklo_epi16(lo,zero)));
+		_mm_storeu_si128(out + 1,_mm_add_epi32(_mm_loadu_si128(out + 1),_mm_unpackhi_epi16(lo,zero)));
+		_mm_storeu_si128(out + 2,_mm_add_epi32(_mm_loadu_si128(out + 2),_mm_unpacklo_epi16(hi,zero)));
+		_mm_storeu_si128(out + 3,_mm_add_epi32(_mm_loadu_si128(out + 3),_mm_unpackhi_epi16(hi,zero)));
+	}
+#endif
+	for (; x < n; x++) acc[x] += row[x];
+}
+
+void addRow(const ushort* row, uint32_t* acc, int n) {
+	int x = 0;
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128();
+	for (; x + 8 <= n; x += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(row + x));
+		__m128i* out = (__m128i*)(acc + x);
+		_mm_storeu_si128(out,_mm_add_epi32(_mm_loadu_si128(out),_mm_unpacklo_epi16(v,zero)));
+		_mm_storeu_si128(out + 1,_mm_add_epi32(_mm_loadu_si128(out + 1),_mm_unpackhi_epi16(v,zero)));
+	}
+#endif
+	for (; x < n; x++) acc[x] += row[x];
+}
+
+// Box-filter downscale of one plane (or interleaved channels, each on its own) by a whole factor,
+// each output sample is the rounded mean of its block
+// summing each block's rows first means every source sample is touched once, and the horizontal pass runs once per output row
+template <typename T>
+void boxPlane(const Mat& src, Mat& dst, Size size) {
+	int s = min(src.cols/size.width,src.rows/size.height);
+	int cn = src.channels();
+	int span = size.width*s*cn;
+	uint32_t area = s*s;
+	dst.create(size,src.type());
+	vector<uint32_t> acc(span);
+	for (int y = 0; y < size.height; y++) {
+		fill(acc.begin(),acc.end(),0);
+		for (int k = 0; k < s; k++) addRow(src.ptr<T>(y*s + k),acc.data(),span);
+		T* out = dst.ptr<T>(y);
+		for (int x = 0; x < size.width; x++) {
+			for (int c = 0; c < cn; c++) {
+				uint32_t total = 0;
+				for (int j = 0; j < s; j++) total += acc[(x*s + j)*cn + c];
+				out[x*cn + c] = (total + area/2)/area;
+			}
+		}
+	}
+}
+
+// Box-filter downscale of BGR straight to gray, same fixed point weights as cvtColor's BGR2GRAY (14 bits)
+// the gray image is never stored: the rows of a block are summed per byte with the same vector addRow as a plane,
+// and the weights are applied once per block to its three channel sums, which rounds to the same result
+void boxGray(const Mat& src, Mat& dst, Size size) {
+	int s = min(src.cols/size.width,src.rows/size.height);
+	int span = size.width*s;
+	uint64_t area = (uint64_t)s*s << 14;
+	dst.create(size,CV_8UC1);
+	vector<uint32_t> acc(3*span);
+	for (int y = 0; y < size.height; y++) {
+		fill(acc.begin(),acc.end(),0);
+		for (int k = 0; k < s; k++) addRow(src.ptr<uchar>(y*s + k),acc.data(),3*span);
+		uchar* out = dst.ptr<uchar>(y);
+		for (int x = 0; x < size.width; x++) {
+			uint64_t b = 0, g = 0, r = 0;
+			const uint32_t* block = acc.data() + 3*x*s;
+			for (int j = 0; j < s; j++) {
+				b += block[3*j];
+				g += block[3*j + 1];
+				r += block[3*j + 2];
+			}
+			out[x] = (b*1868 + g*9617 + r*4899 + area/2)/area;
+		}
+	}
+}
+
+// Reduces a plane (or BGR, which also becomes gray) to a comparison size with the chosen filter
+// the box filter averages away sensor and dither noise that nearest neighbour would pass through as change
+void downscale(const Mat& src, Mat& dst, Size size) {
+	if (AREA_FILTER && size.width > 0 && size.height > 0 && src.cols >= size.width && src.rows >= size.height) {
+		if (src.channels() == 3) boxGray(src,dst,size);
+		else if (src.depth() == CV_16U) boxPlane<ushort>(src,dst,size);
+		else boxPlane<uchar>(src,dst,size);
+	} else if (src.channels() == 3) {
+		Mat temp;
+		cvtColor(src,temp,COLOR_BGR2GRAY);
+		resize(temp,dst,size,0,0,INTER_NEAREST);
+	} else {
+		resize(src,dst,size,0,0,INTER_NEAREST);
+	}
+}
+
+// Builds the small grayscale image used for matching
+// planar frames already start with their luma, so they skip the color conversion
+// with chroma, U and V are scaled to half the comparison size and stored side by side below the luma,
+// so the one difference pass over the image covers all three planes
+// BGR is reduced to the comparison size in one pass before any conversion, the color math then only runs on the small image
+void prepareComparison(const Mat& frame, Mat& comp, int width, int height) {
+	if (!COMPARE_CHROMA) {
+		downscale(frame.channels() == 1 ? frame.rowRange(0,frame.rows*2/3) : frame,comp,Size(width,height));
+		return;
 	}
-};
+	Mat luma, u, v;
+	if (frame.channels() == 1) {
+		int rows = frame.rows*2/3, cols = frame.cols;
+		// in I420 each chroma plane is a contiguous (rows/2)x(cols/2) block after the luma
+		uchar* u_plane = frame.data + (size_t)rows*cols*frame.elemSize();
+		uchar* v_plane = u_plane + (size_t)rows/2*cols/2*frame.elemSize();
+		luma = frame.rowRange(0,rows);
+		u = Mat(rows/2,cols/2,frame.type(),u_plane);
+		v = Mat(rows/2,cols/2,frame.type(),v_plane);
+	} else {
+		Mat small, yuv;
+		if (AREA_FILTER && frame.cols >= width && frame.rows >= height) boxPlane<uchar>(frame,small,Size(width,height));
+		else resize(frame,small,Size(width,height),0,0,INTER_NEAREST);
+		cvtColor(small,yuv,COLOR_BGR2YUV);
+		Mat planes[3];
+		split(yuv,planes);
+		luma = planes[0];
+		u = planes[1];
+		v = planes[2];
+	}
+	int chroma_width = max(1,width/2), chroma_height = max(1,height/2);
+	comp.create(height + chroma_height,max(width,chroma_width*2),luma.type());
+	if (comp.cols > chroma_width*2) comp.setTo(Scalar(0)); // odd widths leave a column beside the chroma
+	Mat temp, roi;
+	downscale(luma,temp,Size(width,height));
+	roi = comp(Range(0,height),Range(0,width));
+	temp.copyTo(roi);
+	downscale(u,temp,Size(chroma_width,chroma_height));
+	roi = comp(Range(height,height + chroma_height),Range(0,chroma_width));
+	temp.copyTo(roi);
+	downscale(v,temp,Size(chroma_width,chroma_height));
+	roi = comp(Range(height,height + chroma_height),Range(chroma_width,chroma_width*2));
+	temp.copyTo(roi);
+}
 
-// Global definitions, using globals for speed
-VideoCapture CAP;
-VideoWriter VIDEO;
-double FPS; // actually should be double because even at 60 fps, video could be fractional (e.g. 59.96 fps)
-Threshold THRESH; // starts on strict
-int WRITE_INDEX = 0; // global index counter to track progress
-int COMP_WIDTH;
-int COMP_HEIGHT;
-chrono::time_point<chrono::system_clock> START;
-chrono::time_point<chrono::system_clock> RUNNING;
-double LAST_FPS = 0.0, LAST_SPEED = 0.0; // not a true moving average, but average reporting with last to keep some form of stability
-int LAST_INDEX = 0; // additional index tracking for reading and reporting
-int READ_INDEX = -1; // starts at -1 since 0-based (first frame is actually 0)
-int TOTAL_LENGTH;
-bool FINISHED = false;
-int DRIFT = 0; // used to manage adjustment bounds
+// Picks a reader by file name: y4m and raw yuv are mapped natively, everything else goes through OpenCV
+Source* openSource(const string& name) {
+	if (hasExtension(name,".y4m") || hasExtension(name,".yuv")) {
+		RawSource* raw = new RawSource();
+		if (raw->open(name,RAW_WIDTH,RAW_HEIGHT,RAW_FPS,RAW_BITS)) return raw;
+		delete raw;
+		return NULL;
+	}
+#ifdef FRAMEFIXER_LIBAV
+	if (NATIVE_YUV || CODEC_HINTS) {
+		LibavSource* decoder = new LibavSource();
+		if (decoder->open(name,CODEC_HINTS)) return decoder;
+		delete decoder;
+		return NULL;
+	}
+#endif
+	CaptureSource* capture = new CaptureSource();
+	if (capture->open(name)) return capture;
+	delete capture;
+	return NULL;
+}
 
-// Catching ctrl-c allows program to stop and write current progress
-void signal_handler(int s) {
-	FINISHED = true;
-	cout << "Finished writing " << WRITE_INDEX << " frames, quitting..." << endl;
-	CAP.release();
-	VIDEO.release();
-	exit(1);
+// Picks a writer by file name, matching the input codec when going through OpenCV
+// with COPY_AUDIO, the audio of input over the frames being processed goes into the same container
+Sink* openSink(const Output& out, const Source& source, double fps, const string& input) {
+	const string& name = out.name;
+	if (hasExtension(name,".y4m") || hasExtension(name,".yuv")) {
+		if (COPY_AUDIO) cout << "y4m and yuv outputs can't hold audio, writing video only" << endl;
+		if (out.vfr) cout << "y4m and yuv outputs have no timestamps, repeating frames" << endl;
+		if (out.encoder.configured()) cout << "y4m and yuv outputs aren't encoded, ignoring encoder settings for " << out.name << endl;
+		RawSink* raw = new RawSink();
+		if (raw->open(name,hasExtension(name,".y4m"),source.width,source.height,fps,source.bits)) return raw;
+		delete raw;
+		return NULL;
+	}
+#ifdef FRAMEFIXER_LIBAV
+	if (NATIVE_YUV || COPY_AUDIO || out.vfr || out.encoder.configured()) {
+		LibavSink* encoder = new LibavSink();
+		encoder->vfr = out.vfr;
+		encoder->settings = out.encoder;
+		double audio_start = START_INDEX/FPS, audio_end = (END_INDEX < INT_MAX) ? END_INDEX/FPS : 0.0;
+		if (encoder->open(name,source,fps,COPY_AUDIO ? input : string(),audio_start,audio_end)) {
+			if (COPY_AUDIO) cout << "Copying " << encoder->audio_streams << " audio streams from the input" << endl;
+			if (out.vfr && !encoder->vfr) cout << name << " has no timestamps, repeating frames" << endl;
+			if (encoder->fell_back) cout << "Unable to open encoder " << out.encoder.name << ", using " << encoder->codec << endl;
+			if (!encoder->ignored.empty()) cout << encoder->codec << " has no " << encoder->ignored << " option, ignoring" << endl;
+			return encoder;
+		}
+		delete encoder;
+		cout << "Unable to encode " << name << " natively, falling back to OpenCV" << (COPY_AUDIO ? " without audio" : "") << endl;
+	}
+#else
+	(void)input; // only the native encoder copies audio from the input
+#endif
+	// raw inputs have no codec to copy, so fall back to one every OpenCV build can write
+	int fourcc = (source.fourcc != 0) ? source.fourcc : VideoWriter::fourcc('M','J','P','G');
+	const string& code = out.encoder.name;
+	if (code.size() == 4) fourcc = VideoWriter::fourcc(code[0],code[1],code[2],code[3]);
+	WriterSink* writer = new WriterSink();
+	if (writer->open(name,fourcc,fps,Size(source.width,source.height),source.bits)) return writer;
+	delete writer;
+	return NULL;
 }
 
-// Frame matching algorithm, rely on standard deviation at the moment, although a variety of methods
-bool matchFrames(const Mat& a, const Mat& b, double& stdev) {
-	// Primary method for frame comparison
-	// Setup
-	Mat diff, mean, std;
-	// Get absolute difference between frames
-	absdiff(a,b,diff);
-	// Average the total change and get the standard deviation over the entire frame
-	// Standard deviation is an excellent measure of the intensity of differences between the frames
-	meanStdDev(diff,mean,std);
-	// Save standard deviation to stdev for caller to use to determine frame similarity
-	stdev = std.at<double>(0);
-	// Return bool representing decision of match (true if they match, false if not a match)
-	if (stdev < THRESH.value) {
-		return true;
+// Read frame helper, writes into frame passed-by reference and returns true if read, false if not
+// decoded holds frames from sources that may reuse their buffer on the next read, which are copied into the pool
+bool readFrame(Source& vidin, PooledFrame& pooled, Mat& decoded) {
+	pooled.hinted = pooled.still = false;
+	if (pooled.index >= END_INDEX || STOPPED) { // past the requested range or stopped, behave like the end of the file
+		pooled.read = false;
+	} else if (vidin.stable) {
+		pooled.read = vidin.read(pooled.data);
 	} else {
+		pooled.read = vidin.read(decoded);
+		if (pooled.read) decoded.copyTo(pooled.data);
+	}
+	if (!pooled.read) {
 		return false;
 	}
+	pooled.hinted = vidin.hinted;
+	pooled.still = vidin.still;
+	pooled.coded_bpp = vidin.coded_bpp;
+	prepareComparison(pooled.data,pooled.comp,COMP_WIDTH,COMP_HEIGHT);
+	if (PYRAMID_SCALE > 1) { // the coarse level is built from comp, so it's cheap and keeps any chroma band
+		downscale(pooled.comp,pooled.coarse,Size(pooled.comp.cols/PYRAMID_SCALE,pooled.comp.rows/PYRAMID_SCALE));
+	}
+	return true;
 }
 
-// Writes a certain frame a specified number of times, increments global index counter
-void writeFrames(VideoWriter& vidout, const Mat& frame, int& count) {
-	// write current frame as many times as specified
-	while (count > 0) {
-		vidout.write(frame); WRITE_INDEX++;
-		count--;
+// Decode stage: reads and prepares frames ahead of the matcher into handles freed by the encode stage
+// the handle after the last frame goes out with read unset, which ends the other stages in turn
+void decodeFrames() {
+	placeThread(DECODE_STAGE); // before the first read, so pooled frames are allocated on this stage's node
+	Mat decoded;
+	for (int index = START_INDEX; ; index++) {
+		int handle;
+		FREE_QUEUE.pop(handle);
+		FRAME_POOL[handle].index = index;
+		bool read = readFrame(*SOURCE,FRAME_POOL[handle],decoded);
+		DECODED_QUEUE.push(handle);
+		if (!read) break;
 	}
 }
 
-// Read frame helper, writes into frame passed-by reference and returns true if read, false if not
-bool readFrame(VideoCapture& vidin, Mat& frame, Mat& comp) {
-	vidin >> frame; READ_INDEX++;
-	if (frame.empty()) {
-		return false;
+// Hands the matcher the next decoded frame, false at the end of the input
+bool nextFrame(int& handle) {
+	DECODED_QUEUE.pop(handle);
+	READ_INDEX = FRAME_POOL[handle].index;
+	return FRAME_POOL[handle].read;
+}
+
+// Returns a frame that will never be written to the decode stage, through the encode stages so each ring keeps one producer
+void releaseFrame(int handle) {
+	EncodeJob job = {handle,WRITE_INDEX,0};
+	OUTPUTS[0]->queue->push(job);
+}
+
+// Encode stage of the n-th output: writes frames as the allocator settles their counts, then passes them on
+// the next output's stage gets each frame after this one, and the last frees the handle for reading again
+void encodeFrames(int n) {
+	placeThread(ENCODE_STAGE + n);
+	Output& out = *OUTPUTS[n];
+	SpscRing<EncodeJob>* next = (n + 1 < (int)OUTPUTS.size()) ? OUTPUTS[n + 1]->queue : NULL;
+	EncodeJob job;
+	while (true) {
+		out.queue->pop(job);
+		if (job.handle >= 0) {
+			int repeats = out.take(job.slot,job.slots);
+			if (repeats > 0) out.sink->write(FRAME_POOL[job.handle].data,repeats);
+		}
+		if (next != NULL) next->push(job); // end of input goes down the chain as well
+		else if (job.handle >= 0) FREE_QUEUE.push(job.handle);
+		if (job.handle < 0) break;
+	}
+}
+
+// Reads an initial window of the input on its own capture and fits the thresholds to it before processing starts
+void calibrateWindow(const string& input, int start, int frames) {
+	Source* source = openSource(input);
+	if (source == NULL) return;
+	if (start > 0) source->seek(start);
+	vector<double> stdevs;
+	Mat frame, comp, last;
+	double stdev;
+	while ((int)stdevs.size() < frames && source->read(frame)) {
+		prepareComparison(frame,comp,COMP_WIDTH,COMP_HEIGHT);
+		if (!last.empty()) {
+			matchFrames(last,comp,stdev);
+			stdevs.push_back(stdev);
+		}
+		swap(last,comp);
+	}
+	delete source;
+	if (CALIBRATOR.fit(stdevs)) {
+		cout << "Calibrated from " << stdevs.size() << " comparisons, separation=" << CALIBRATOR.separation << endl;
 	} else {
-		Mat temp;
-		cvtColor(frame,temp,COLOR_BGR2GRAY);
-		resize(temp,comp,Size(COMP_WIDTH,COMP_HEIGHT),0,0,INTER_NEAREST);
-		return true;
+		cout << "Calibration found no clear split between duplicates and changes, keeping thresholds" << endl;
+	}
+}
+
+// Maps memory for the frame pool, preferring pages that cover a whole frame or more with one TLB entry
+// explicit huge pages only exist if vm.nr_hugepages reserved some, otherwise transparent ones are requested,
+// and where neither is available it's a plain mapping; backing names what was actually used
+unsigned char* mapPool(size_t& bytes, string& backing) {
+	void* memory = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	const size_t HUGE_PAGE = 2 << 20;
+	size_t rounded = (bytes + HUGE_PAGE - 1)/HUGE_PAGE*HUGE_PAGE; // hugetlb mappings are whole pages
+	memory = mmap(NULL,rounded,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,-1,0);
+	if (memory != MAP_FAILED) {
+		bytes = rounded;
+		backing = "explicit huge pages";
+		return (unsigned char*)memory;
+	}
+#endif
+	memory = mmap(NULL,bytes,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+	if (memory == MAP_FAILED) return NULL;
+	backing = "4k pages";
+#ifdef MADV_HUGEPAGE
+	if (madvise(memory,bytes,MADV_HUGEPAGE) == 0) backing = "transparent huge pages";
+#endif
+	return (unsigned char*)memory;
+}
+
+// Unmaps the frame pool, the pooled images must not be used after this
+void releasePool() {
+	if (POOL_MEMORY != NULL) munmap(POOL_MEMORY,POOL_BYTES);
+	POOL_MEMORY = NULL;
+	POOL_BYTES = 0;
+}
+
+// Points every pooled frame, comparison image and coarse level at its own piece of one mapping
+// sizes come from preparing a blank frame in the source's format; the decode stage's create() calls then find
+// the images already the right size and fill them in place, and nothing is touched here, so pages stay node-local
+void backPool(const Source& source, string& backing) {
+	Mat blank = source.planar ? Mat(source.height*3/2,source.width,source.bits > 8 ? CV_16UC1 : CV_8UC1,Scalar(0))
+		: Mat(source.height,source.width,CV_8UC3,Scalar(0));
+	Mat comp, coarse;
+	prepareComparison(blank,comp,COMP_WIDTH,COMP_HEIGHT);
+	if (PYRAMID_SCALE > 1) downscale(comp,coarse,Size(comp.cols/PYRAMID_SCALE,comp.rows/PYRAMID_SCALE));
+	const Mat* shapes[3] = {source.file_views ? NULL : &blank, &comp, &coarse}; // mapped frames point into the file instead
+	size_t sizes[3], frame_bytes = 0;
+	for (int i = 0; i < 3; i++) {
+		sizes[i] = (shapes[i] == NULL || shapes[i]->empty()) ? 0 : (shapes[i]->total()*shapes[i]->elemSize() + 63)/64*64;
+		frame_bytes += sizes[i];
+	}
+	size_t needed = frame_bytes*FRAME_POOL.size();
+	// a job placed elsewhere by -cpus or -numa_node gets a fresh mapping, the kept one's pages are on the old node
+	vector<int> cpus = threadCpus(DECODE_STAGE);
+	if (POOL_MEMORY != NULL && needed <= POOL_BYTES && cpus == POOL_CPUS) {
+		backing = POOL_BACKING + ", kept from the last job"; // -serve, already faulted in and on the right pages
+	} else {
+		releasePool();
+		POOL_BYTES = needed;
+		POOL_MEMORY = (needed > 0) ? mapPool(POOL_BYTES,backing) : NULL;
+		POOL_BACKING = backing;
+		POOL_CPUS = cpus;
+	}
+	if (POOL_MEMORY == NULL) return;
+	unsigned char* next = POOL_MEMORY;
+	for (size_t h = 0; h < FRAME_POOL.size(); h++) {
+		Mat* images[3] = {&FRAME_POOL[h].data, &FRAME_POOL[h].comp, &FRAME_POOL[h].coarse};
+		for (int i = 0; i < 3; i++) {
+			if (sizes[i] == 0) continue;
+			*images[i] = Mat(shapes[i]->rows,shapes[i]->cols,shapes[i]->type(),next);
+			next += sizes[i];
+		}
+	}
+}
+
+// Counts dTLB load misses of this thread and the threads it starts from now on, -1 where perf events aren't available
+// inherited counts are added in as each thread exits, so read it after joining the stages
+int openTlbCounter() {
+#ifdef __linux__
+	struct perf_event_attr attr;
+	memset(&attr,0,sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open,&attr,0,-1,-1,0);
+#else
+	return -1;
+#endif
+}
+
+// Priority of the frame just read: the bits the encoder spent on it when the decoder reports them, otherwise its stdev
+// coded size covers both residual and motion, so it ranks how much a frame changed without looking at pixels
+// the two aren't comparable, so the first frame without hints switches the run, and the buffer, over to stdev
+double framePriority(FrameRing& buffer, int handle, double stdev) {
+	PooledFrame& pooled = FRAME_POOL[handle];
+	pooled.stdev = stdev;
+	if (HINT_PRIORITY && !pooled.hinted) {
+		HINT_PRIORITY = false;
+		for (int position = 0; position < buffer.size(); position++) {
+			int slot = buffer.at(position);
+			buffer.priority[slot] = FRAME_POOL[buffer.handle[slot]].stdev;
+		}
+		cout << "frame " << pooled.index << " has no codec statistics, ranking frames by stdev from here" << endl;
+	}
+	return HINT_PRIORITY ? pooled.coded_bpp : stdev;
+}
+
+// Sets the slots each buffered frame from a position on needs, from the slot it will actually be written at
+// a frame needs to reach the first slot picked at or after its start, so any frame holding its required count survives
+// the picks are the first output's when it samples at a lower rate, and otherwise those of a later decimation at
+// duplicate_count, phased like -target_fps would sample the output; the start is the write index plus the counts of
+// the frames in front, so this runs again whenever one of those changes
+void planSlots(FrameRing& buffer, int from = 0) {
+	const Cadence& picks = (OUTPUTS[0]->target_fps > 0) ? OUTPUTS[0]->slot_step : CADENCE;
+	long long start = WRITE_INDEX;
+	for (int position = 0; position < from; position++) start += buffer.count[buffer.at(position)];
+	for (int position = from; position < buffer.size(); position++) {
+		int slot = buffer.at(position);
+		buffer.required[slot] = (int)(picks.nextPick(start) - start + 1);
+		start += buffer.count[slot];
+	}
+}
+
+// Creates a buffer entry for newly read content
+void newFrame(FrameRing& buffer, int handle, double priority, bool cut) {
+	int slot = buffer.push();
+	buffer.handle[slot] = handle; // the pooled frame stays put until the encode stage has written it
+	buffer.count[slot] = 1;
+	buffer.priority[slot] = priority;
+	buffer.index[slot] = FRAME_POOL[handle].index;
+	buffer.cut[slot] = cut;
+	planSlots(buffer,buffer.size() - 1);
+}
+
+// Moves slots to the frame at a position until it has the ones it requires, from frames in the same scene
+// spare slots are taken first, then those of lower priority frames; with newer_only, frames in front of it keep theirs,
+// which is how the frame about to be written gets its last chance without moving any slot that's already planned
+void fillRequired(FrameRing& buffer, int position, bool newer_only) {
+	int tofix = buffer.at(position);
+	// only frames in the same scene can give up slots, a cut marks the start of the next segment
+	int segment_begin = position, segment_end = position + 1;
+	while (!newer_only && segment_begin > 0 && !buffer.cut[buffer.at(segment_begin)]) segment_begin--;
+	while (segment_end < buffer.size() && !buffer.cut[buffer.at(segment_end)]) segment_end++;
+	bool fixing = (segment_end - segment_begin > 1); // necessary to avoid infinite loop with dup adjusting, and a lone frame has no donors
+	const int* count = buffer.count.data();
+	const int* required = buffer.required.data();
+	const double* priority = buffer.priority.data();
+	while (fixing && count[tofix] < required[tofix]) {
+		// will do one step of frame adjustment each loop
+		// first, see if any other slot can offer this frame a place without risk of loss
+		// no need to exclude tofix itself; it couldn't be in this loop if its count were over its required count
+		int donor = buffer.findNewest(segment_begin,segment_end,[&](int slot) { return count[slot] > required[slot]; });
+		// if not, check priority and take a slot from a lower priority frame if need be
+		if (donor < 0) { // enforce that frames not allowed to be dropped with count > 1
+			donor = buffer.findNewest(segment_begin,segment_end,[&](int slot) { return priority[slot] < priority[tofix] && count[slot] > 1; });
+		}
+		fixing = (donor >= 0);
+		if (fixing) {
+			buffer.count[donor]--;
+			buffer.count[tofix]++;
+			planSlots(buffer,segment_begin); // the frames between the two have moved
+		}
 	}
 }
 
@@ -141,7 +2231,11 @@ void timeReporting() {
 		<< "fps= " << new_fps << "  "
 		<< "time= " << current_index/FPS << "s  "
 		<< "speed= " << new_speed << "x  "
-		<< "total= " << 100.0*current_index/TOTAL_LENGTH << "%  " 
+		<< "total= " << 100.0*(current_index - START_INDEX)/TOTAL_LENGTH << "%  " 
+		<< "queues= " << DECODED_QUEUE.size();
+	// the rings rather than the outputs, which main may be deleting as the last report prints
+	for (int i = 0; i < ENCODE_STAGES; i++) cout << "," << ENCODE_QUEUES[i].size();
+	cout << "/" << QUEUE_DEPTH << "  "
 		<< "runtime= " << global_difference << "s" << endl;
 	
 	// Update tracking
@@ -155,9 +2249,10 @@ void timeReporting() {
 void timeReportingManager() {
 	START = chrono::system_clock::now();
 	RUNNING = START; // running timer tied with start timer at start
-	while(!FINISHED) {
-		this_thread::sleep_for(chrono::seconds(1));
-		timeReporting();
+	// short sleeps so a finished run isn't held up waiting to join this thread
+	for (int tick = 1; !FINISHED; tick++) {
+		this_thread::sleep_for(chrono::milliseconds(100));
+		if (tick % 10 == 0) timeReporting();
 	}
 	chrono::time_point<chrono::system_clock> current_time = chrono::system_clock::now();
 	chrono::duration<float> time_duration = current_time - START;
@@ -166,8 +2261,167 @@ void timeReportingManager() {
 	cout << TOTAL_LENGTH << " frames processed in " << time_difference << " seconds" << endl;
 }
 
+// Probing decodes short bursts spread evenly across the input and recommends settings without a full run
+// each burst gets its own capture and worker thread, so a multi-hour file is characterized in seconds
+const int PROBE_SCALES[] = {2, 4, 8}; // candidate comparison scales, finest first
+const int PROBE_SCALE_COUNT = 3;
+
+int probe(const string& input, int points, int burst) {
+	Source* source = openSource(input);
+	if (source == NULL) {
+		cout << "Error opening video stream, quitting..." << endl;
+		return -1;
+	}
+	int width = source->width;
+	int height = source->height;
+	int length = source->length;
+	double fps = source->fps;
+	COMP_UNIT = 1 << (source->bits - 8);
+	delete source;
+	points = max(1,min(points,length/max(1,burst))); // bursts shouldn't overlap on short files
+
+	// stdevs[point][scale] holds the consecutive frame stdevs of each burst at each candidate scale
+	vector<vector<vector<double> > > stdevs(points,vector<vector<double> >(PROBE_SCALE_COUNT));
+	atomic<int> next(0);
+	chrono::time_point<chrono::system_clock> start = chrono::system_clock::now();
+	auto worker = [&](int w) {
+		placeThread(w);
+		Mat frame;
+		vector<Mat> comp(PROBE_SCALE_COUNT), last(PROBE_SCALE_COUNT);
+		double stdev;
+		for (int p = next++; p < points; p = next++) {
+			Source* local = openSource(input);
+			if (local == NULL) continue;
+			// centre each burst in its share of the file; the backend seeks to the preceding keyframe and decodes forward
+			local->seek(max(0,(int)((double)length*(2*p + 1)/(2*points)) - burst/2));
+			for (int f = 0; f < burst && local->read(frame); f++) {
+				for (int s = 0; s < PROBE_SCALE_COUNT; s++) {
+					prepareComparison(frame,comp[s],width/PROBE_SCALES[s],height/PROBE_SCALES[s]);
+					if (f > 0) {
+						matchFrames(last[s],comp[s],stdev);
+						stdevs[p][s].push_back(stdev);
+					}
+					swap(last[s],comp[s]);
+				}
+			}
+			delete local;
+		}
+	};
+	vector<thread> workers;
+	int cpus = CPU_LIST.empty() ? (NUMA_NODE >= 0 ? nodeCpus(NUMA_NODE).size() : thread::hardware_concurrency()) : CPU_LIST.size();
+	int worker_count = min(points,max(1,cpus));
+	printTopology();
+	for (int w = 0; w < worker_count; w++) workers.push_back(thread(worker,w));
+	for (size_t w = 0; w < workers.size(); w++) workers[w].join();
+	chrono::duration<float> elapsed = chrono::system_clock::now() - start;
+
+	cout << "Input: " << input << endl
+		<< "Probed " << points << " points x " << burst << " frames in " << elapsed.count() << "s" << endl;
+
+	// prefer the coarsest scale that separates duplicates from changes about as well as the best one
+	double threshold[PROBE_SCALE_COUNT], separation[PROBE_SCALE_COUNT], best = 0.0;
+	bool fitted[PROBE_SCALE_COUNT];
+	for (int s = 0; s < PROBE_SCALE_COUNT; s++) {
+		vector<double> all;
+		for (int p = 0; p < points; p++) all.insert(all.end(),stdevs[p][s].begin(),stdevs[p][s].end());
+		fitted[s] = fitThreshold(all,threshold[s],separation[s]);
+		if (fitted[s]) best = max(best,separation[s]);
+	}
+	int chosen = -1;
+	for (int s = 0; s < PROBE_SCALE_COUNT; s++) {
+		if (fitted[s] && separation[s] >= best - 0.02) chosen = s;
+	}
+	if (chosen < 0) {
+		cout << "No clear split between duplicates and changes; content likely runs at the full " << fps << " fps, FrameFixer isn't needed" << endl;
+		return 0;
+	}
+
+	// duplicate runs at the chosen threshold, only counting runs that start and end inside a burst
+	vector<vector<int> > runs(points);
+	long long run_frames = 0, run_count = 0;
+	for (int p = 0; p < points; p++) {
+		int run = 1;
+		bool started = false;
+		for (size_t i = 0; i < stdevs[p][chosen].size(); i++) {
+			if (stdevs[p][chosen][i] < threshold[chosen]) {
+				run++;
+			} else {
+				if (started) {
+					runs[p].push_back(run);
+					run_frames += run;
+					run_count++;
+				}
+				started = true;
+				run = 1;
+			}
+		}
+	}
+	if (run_count == 0) {
+		cout << "Bursts too short to measure complete runs, try a larger -probe_burst" << endl;
+		return 0;
+	}
+	double mean_run = (double)run_frames/run_count;
+
+	// regularity is the share of runs equal to the run one period earlier, for the best period up to 4
+	int period = 1;
+	double regularity = 0.0;
+	for (int q = 1; q <= 4; q++) {
+		long long same = 0, compared = 0;
+		for (int p = 0; p < points; p++) {
+			for (size_t i = q; i < runs[p].size(); i++) {
+				same += (runs[p][i] == runs[p][i - q]);
+				compared++;
+			}
+		}
+		if (compared > 0 && (double)same/compared > regularity + 0.01) {
+			regularity = (double)same/compared;
+			period = q;
+		}
+	}
+
+	// nearest simple cadence, e.g. 2 for 30 in 60 or 2.5 for 24 in 60
+	int cadence_num = 1, cadence_den = 1;
+	double cadence_error = 1e9;
+	for (int d = 1; d <= 4; d++) {
+		int n = max(d,(int)lround(mean_run*d));
+		if (fabs(mean_run - (double)n/d) < cadence_error - 1e-9) {
+			cadence_error = fabs(mean_run - (double)n/d);
+			cadence_num = n;
+			cadence_den = d;
+		}
+	}
+	double cadence = (double)cadence_num/cadence_den;
+
+	// buffer has to reach past the longest streak of short runs to find a donor on either side
+	int streak = 0, longest = 0;
+	for (int p = 0; p < points; p++) {
+		streak = 0;
+		for (size_t i = 0; i < runs[p].size(); i++) {
+			streak = (runs[p][i] < (int)cadence) ? streak + 1 : 0;
+			longest = max(longest,streak);
+		}
+	}
+	int buffer_size = max(7,2*(longest + 1) + 1);
+
+	double relaxed = threshold[chosen]*THRESH.relaxed/THRESH.strict;
+	cout << "Content fps: " << fps/mean_run << " (" << mean_run << " frames per run), "
+		<< "Cadence regularity: " << 100.0*regularity << "% (period " << period << ")" << endl
+		<< "Noise floor split: threshold_strict=" << threshold[chosen] << ", threshold_relaxed=" << relaxed
+		<< ", separation=" << separation[chosen] << " at comparison_scale " << PROBE_SCALES[chosen] << endl
+		<< "Recommended: -buffer_size " << buffer_size
+		<< " -comparison_scale " << PROBE_SCALES[chosen]
+		// %g so the line pastes back in as is: 2 or 2.5 rather than 2.0000, and small thresholds don't round to zero
+		<< " -duplicate_count " << cv::format("%g",cadence)
+		<< " -threshold_strict " << cv::format("%g",threshold[chosen])
+		<< " -threshold_relaxed " << cv::format("%g",relaxed) << endl;
+	return 0;
+}
+
 void printUsage() {
 	cout << "usage: framefixer <input> <output> [options]" << endl
+		<< "       framefixer -probe <input> [options]" << endl
+		<< "       framefixer -serve <socket>" << endl
+		<< "       framefixer -submit <socket> <input> <output> [options]" << endl
 		<< "  options:" << endl
 		<< "    -buffer_size <integer>" << endl
 		<< "      distinct frames considered when adjusting; default is 7" << endl
@@ -175,16 +2429,125 @@ void printUsage() {
 		<< "      factor by which to reduce frames for matching; default is 4, disable with 1" << endl
 		<< "    -adjustment_bound <integer>" << endl
 		<< "      helps ensure audio stays synced by bounding adjustment distance; default is 5" << endl
-		<< "    -duplicate_count <integer>" << endl
-		<< "      number of times a frame should repeat to avoid being lost; default is 2" << endl
+		<< "    -duplicate_count <float>" << endl
+		<< "      slots a frame needs to avoid being lost, fractions like 2.5 give 3:2 cadences; default is 2, or input/target fps" << endl
 		<< "    -threshold_strict <float>" << endl
 		<< "      standard deviation threshold to use when matching frames; default is 0.5" << endl
 		<< "    -threshold_relaxed <float>" << endl
-		<< "      relaxed comparison threshold; default is strict/2, disable with equal to strict" << endl;
+		<< "      relaxed comparison threshold; default is strict/2, disable with equal to strict" << endl
+		<< "    -target_fps <float>" << endl
+		<< "      write output at this rate, keeping only the slots it samples; default is the input fps" << endl
+		<< "    -cadence_lock <integer>" << endl
+		<< "      1 enables locking onto regular duplicate patterns and confirming predicted duplicates cheaply; default is off" << endl
+		<< "    -calibrate <integer>" << endl
+		<< "      fit thresholds to the noise floor of this many initial frames; default is 0 (off)" << endl
+		<< "    -recalibrate <integer>" << endl
+		<< "      re-estimate thresholds after this many comparisons while running; default is 0 (off)" << endl
+		<< "    -probe_points <integer>" << endl
+		<< "      evenly spaced positions sampled by -probe; default is 16" << endl
+		<< "    -probe_burst <integer>" << endl
+		<< "      frames decoded at each probe position; default is 120" << endl
+		<< "    -raw_width <integer>, -raw_height <integer>, -raw_fps <float>, -raw_bits <integer>" << endl
+		<< "      describe headerless .yuv (I420) input, bits is 8, 10, 12 or 16; y4m and other formats read their own" << endl
+		<< "    -sample_budget <float>" << endl
+		<< "      share of rows (0-1) a comparison samples before scanning the rest; default is 0 (always full scan)" << endl
+		<< "    -scene_cut <float>" << endl
+		<< "      a change this many times the recent average is a cut, frames don't trade slots across it; default is 0 (off)" << endl
+		<< "    -noise_margin <float>" << endl
+		<< "      keep threshold_strict at least this many times the tracked noise floor; default is 0 (off)" << endl
+		<< "    -comparison_filter <area|nearest>" << endl
+		<< "      how comparison images are reduced, area averages away noise; default is area" << endl
+		<< "    -pyramid_scale <integer>" << endl
+		<< "      compare first at comparison_scale times this, finer only for borderline frames; default is 0 (off)" << endl
+		<< "    -compare_chroma <integer>" << endl
+		<< "      1 adds the color planes to the comparison so luma-preserving changes count; default is 0" << endl
+		<< "    -native_yuv <integer>" << endl
+		<< "      1 keeps frames in 4:2:0 from decode to encode (libav builds); y4m/yuv always are; default is 0" << endl
+		<< "    -codec_hints <integer>" << endl
+		<< "      1 ranks frames by coded size and skips comparing frames the encoder coded as duplicates (libav builds); default is 0" << endl
+		<< "    -copy_audio <integer>" << endl
+		<< "      1 copies the input's audio streams into the output, trimmed to -ss/-to (libav builds); default is 0" << endl
+		<< "    -vfr <integer>" << endl
+		<< "      1 encodes each frame once, shown for as many slots as it was given, in containers with timestamps (libav builds); default is 0" << endl
+		<< "    -encoder <name>" << endl
+		<< "      libavcodec encoder, e.g. libx264, or a fourcc for OpenCV builds; default is the input's codec" << endl
+		<< "    -encoder_threads <integer>, -preset <name>, -crf <float>, -bitrate <float>" << endl
+		<< "      encoder threads (default one per core), speed preset, constant quality (0 or more, 0 is lossless on some encoders) and bitrate in kbit/s (libav builds)" << endl
+		<< "    -output <name>[:key=value...]" << endl
+		<< "      also write the result here from the same pass, keys are target_fps, vfr, encoder, encoder_threads, preset, crf and bitrate; repeatable" << endl
+		<< "    -cpus <list>" << endl
+		<< "      pin the decode, match and encode threads (or probe workers) to these cpus in turn, e.g. 0-2 or 4,6,8; default is unpinned (Linux)" << endl
+		<< "    -numa_node <integer>" << endl
+		<< "      keep every thread, and so the frames each allocates, on this node's cpus; default is -1 (any node) (Linux)" << endl
+		<< "    -huge_pages <integer>" << endl
+		<< "      1 puts all pooled frames and comparison images in one mapping on huge pages, falling back to normal pages; default is 0" << endl
+		<< "    -ss <float>" << endl
+		<< "      start processing at this time in seconds; default is the beginning" << endl
+		<< "    -to <float>" << endl
+		<< "      stop processing at this time in seconds; default is the end" << endl;
+}
+
+// Puts every option and counter back to its default and releases whatever a failed run left open
+// a one-off run starts from these anyway, -serve depends on it to keep one job's settings out of the next
+void resetState() {
+	if (SOURCE != NULL) {
+		SOURCE->release();
+		delete SOURCE;
+		SOURCE = NULL;
+	}
+	for (size_t i = 0; i < OUTPUTS.size(); i++) {
+		if (OUTPUTS[i]->sink != NULL) {
+			OUTPUTS[i]->sink->release();
+			delete OUTPUTS[i]->sink;
+		}
+		delete OUTPUTS[i];
+	}
+	OUTPUTS.clear();
+	RAW_WIDTH = RAW_HEIGHT = 0;
+	RAW_FPS = 0.0;
+	RAW_BITS = 8;
+	CODEC_HINTS = false;
+	PREFILTERED = 0;
+	HINT_PRIORITY = false;
+	NATIVE_YUV = false;
+	COPY_AUDIO = false;
+	THRESH = Threshold();
+	WRITE_INDEX = 0;
+	LAST_FPS = LAST_SPEED = 0.0;
+	LAST_INDEX = 0;
+	READ_INDEX = -1;
+	START_INDEX = 0;
+	END_INDEX = INT_MAX;
+	FINISHED = false;
+	STOPPED = false;
+	DRIFT = 0;
+	CADENCE = Cadence();
+	TRACKER = CadenceTracker();
+	NOISE = NoiseTracker();
+	SCENES = SceneCuts();
+	CALIBRATOR = Calibrator();
+	AREA_FILTER = true;
+	COMPARE_CHROMA = false;
+	PYRAMID_SCALE = 0;
+	PYRAMID_DECIDED = PYRAMID_DESCENDED = 0;
+	for (int side = 0; side < 2; side++) {
+		PYRAMID_RATIO[side] = 0.0;
+		PYRAMID_CHECKED[side] = PYRAMID_SINCE[side] = 0;
+	}
+	SAMPLE_BUDGET = 0.0;
+	SAMPLED_ROWS = SAMPLED_EARLY = SAMPLED_COMPARISONS = SAMPLED_TOTAL_ROWS = 0;
+	COMP_UNIT = 1.0;
+	ENCODE_STAGES = 0;
+	CPU_LIST.clear();
+	NUMA_NODE = -1;
+	HUGE_PAGES = false;
 }
 
 // Main body
-int main(int argc, char* argv[]) {
+// One run over one input, from parsing its arguments to releasing everything it opened
+// a plain invocation runs it once, -serve once per job on the state left by the last one
+int run(int argc, char* argv[]) {
+	resetState();
 	
 	// Argument handling
 	if (argc < 3) {
@@ -196,18 +2559,79 @@ int main(int argc, char* argv[]) {
 	int buffer_size = 7;
 	int comparison_scale = 4;
 	int adjustment_bound = 5;
-	int duplicate_count = 2;
+	double duplicate_count = -1;
+	double target_fps = -1;
 	double threshold_strict = -1, threshold_relaxed = -1;
+	double range_start = -1, range_end = -1;
+	int probe_points = 16;
+	int probe_burst = 120;
+	string cpus_arg;
+	Output* primary = new Output(); // the output named second on the command line, set up by the options without -output
+	OUTPUTS.push_back(primary);
 	
-	input = argv[1];
-	output = argv[2];
+	// probe mode only takes an input, every other run has an input and an output
+	bool probing = (string(argv[1]) == "-probe");
+	if (probing) {
+		input = argv[2];
+	} else {
+		input = argv[1];
+		output = argv[2];
+		primary->name = output;
+	}
 	
 	if (argc > 3) {
 		string arg;
-		double val; // use double to get threshold values less than 1, all other args just truncate to int anyways
+		double val; // use double to get threshold values less than 1 and fractional cadences, other args just truncate to int anyways
 		try {
 			for (int i = 3; i < argc; i++) {
 				arg = argv[i];
+				// options taking a name, a list or a value that may be 0
+				if (arg == "-comparison_filter" && i + 1 < argc) {
+					string filter = argv[++i];
+					if (filter == "area") AREA_FILTER = true;
+					else if (filter == "nearest") AREA_FILTER = false;
+					else cout << "comparison_filter must be area or nearest, using default value" << endl;
+					continue;
+				}
+				if (arg == "-cpus" && i + 1 < argc) {
+					cpus_arg = argv[++i];
+					CPU_LIST = parseCpuList(cpus_arg);
+					if (CPU_LIST.empty()) cout << "cpus must be a list like 0-3,8, ignoring" << endl;
+					continue;
+				}
+				if (arg == "-encoder" && i + 1 < argc) {
+					primary->encoder.name = argv[++i];
+					continue;
+				}
+				if (arg == "-preset" && i + 1 < argc) {
+					primary->encoder.preset = argv[++i];
+					continue;
+				}
+				if (arg == "-output" && i + 1 < argc) {
+					Output* extra = parseOutput(argv[++i]);
+					if (extra == NULL) continue;
+					if ((int)OUTPUTS.size() >= MAX_OUTPUTS) {
+						cout << "at most " << MAX_OUTPUTS << " outputs are supported, skipping " << extra->name << endl;
+						delete extra;
+						continue;
+					}
+					OUTPUTS.push_back(extra);
+					continue;
+				}
+				if (arg == "-numa_node" && i + 1 < argc) {
+					if (sscanf(argv[++i],"%d",&NUMA_NODE) != 1 || NUMA_NODE < 0 || nodeCpus(NUMA_NODE).empty()) {
+						cout << "numa_node must be a node with cpus, ignoring" << endl;
+						NUMA_NODE = -1;
+					}
+					continue;
+				}
+				if (arg == "-crf" && i + 1 < argc) {
+					if (sscanf(argv[++i],"%lf",&primary->encoder.crf) != 1 || primary->encoder.crf < 0) {
+						cout << "crf must be 0 or more, using the encoder's default" << endl;
+						primary->encoder.crf = -1.0;
+					}
+					continue;
+				}
 				sscanf(argv[++i],"%lf",&val); // increment i and read val; goes to catch() if args not passed this way
 				if (val <= 0) {
 					cout << "all args must be positive values, using default value for " << arg << endl;
@@ -221,6 +2645,30 @@ int main(int argc, char* argv[]) {
 					else if (arg == "-duplicate_count") duplicate_count = val;
 					else if (arg == "-threshold_strict") threshold_strict = val;
 					else if (arg == "-threshold_relaxed") threshold_relaxed = val;
+					else if (arg == "-target_fps") target_fps = val;
+					else if (arg == "-cadence_lock") TRACKER.enabled = (val >= 1);
+					else if (arg == "-calibrate") CALIBRATOR.window = val;
+					else if (arg == "-recalibrate") CALIBRATOR.interval = val;
+					else if (arg == "-probe_points") probe_points = val;
+					else if (arg == "-probe_burst") probe_burst = val;
+					else if (arg == "-raw_width") RAW_WIDTH = val;
+					else if (arg == "-raw_height") RAW_HEIGHT = val;
+					else if (arg == "-raw_fps") RAW_FPS = val;
+					else if (arg == "-raw_bits") RAW_BITS = val;
+					else if (arg == "-native_yuv") NATIVE_YUV = (val >= 1);
+					else if (arg == "-codec_hints") CODEC_HINTS = (val >= 1);
+					else if (arg == "-huge_pages") HUGE_PAGES = (val >= 1);
+					else if (arg == "-copy_audio") COPY_AUDIO = (val >= 1);
+					else if (arg == "-vfr") primary->vfr = (val >= 1);
+					else if (arg == "-encoder_threads") primary->encoder.threads = val;
+					else if (arg == "-bitrate") primary->encoder.bitrate = val;
+					else if (arg == "-compare_chroma") COMPARE_CHROMA = (val >= 1);
+					else if (arg == "-pyramid_scale") PYRAMID_SCALE = val;
+					else if (arg == "-noise_margin") NOISE.margin = val;
+					else if (arg == "-scene_cut") SCENES.ratio = val;
+					else if (arg == "-sample_budget") SAMPLE_BUDGET = min(1.0,val);
+					else if (arg == "-ss") range_start = val;
+					else if (arg == "-to") range_end = val;
 					else cout << "unrecognized argument " << arg << ", ignoring..." << endl;
 				}
 			}
@@ -242,60 +2690,214 @@ int main(int argc, char* argv[]) {
 		}
 	}
 	
+#ifndef __linux__
+	if (!CPU_LIST.empty() || NUMA_NODE >= 0) {
+		cout << "cpus and numa_node need Linux, leaving thread placement to the scheduler" << endl;
+		CPU_LIST.clear();
+		NUMA_NODE = -1;
+	}
+#endif
+	
+	if (probing) {
+		cout << std::fixed << std::setprecision(2);
+		return probe(input,probe_points,probe_burst);
+	}
+	
+	// the source and sinks start their codec threads on every chosen cpu, this thread is pinned once they're open
+	placeWorkers();
+	
+#ifndef FRAMEFIXER_LIBAV
+	if (NATIVE_YUV) {
+		cout << "native_yuv needs a build with -DFRAMEFIXER_LIBAV, only y4m/yuv files stay native" << endl;
+		NATIVE_YUV = false;
+	}
+	if (CODEC_HINTS) {
+		cout << "codec_hints needs a build with -DFRAMEFIXER_LIBAV, comparing every frame" << endl;
+		CODEC_HINTS = false;
+	}
+	if (COPY_AUDIO) {
+		cout << "copy_audio needs a build with -DFRAMEFIXER_LIBAV, writing video only" << endl;
+		COPY_AUDIO = false;
+	}
+	for (size_t i = 0; i < OUTPUTS.size(); i++) {
+		Output& out = *OUTPUTS[i];
+		if (out.vfr) {
+			cout << "vfr needs a build with -DFRAMEFIXER_LIBAV, repeating frames in " << out.name << endl;
+			out.vfr = false;
+		}
+		if (out.encoder.threads > 0 || !out.encoder.preset.empty() || out.encoder.crf >= 0 || out.encoder.bitrate > 0) {
+			cout << "encoder_threads, preset, crf and bitrate need a build with -DFRAMEFIXER_LIBAV, using OpenCV's defaults for " << out.name << endl;
+		}
+		if (out.encoder.name.size() != 0 && out.encoder.name.size() != 4) {
+			cout << "encoder must be a fourcc like avc1 without -DFRAMEFIXER_LIBAV, copying the input's for " << out.name << endl;
+		}
+	}
+#endif
+	
 	// Video input setup
-	// Create a VideoCapture object and open the input file (string name for file, 0 for webcam)
-	CAP.open(input);
+	// Open the input file, y4m and raw yuv are mapped natively and everything else uses a VideoCapture
+	SOURCE = openSource(input);
 	
-	// Check if VideoCapture opened successfully
-	if(!CAP.isOpened())
+	// Check if the source opened successfully
+	if (SOURCE == NULL)
 	{
 		cout << "Error opening video stream, quitting..." << endl;
 		return -1;
 	}
 	
 	// Copy properties
-	// Default resolution of the frame is obtained. The default resolution is system dependent.
-	int frame_width = CAP.get(CAP_PROP_FRAME_WIDTH);
-	int frame_height = CAP.get(CAP_PROP_FRAME_HEIGHT);
+	int frame_width = SOURCE->width;
+	int frame_height = SOURCE->height;
 	
 	// Comparison sizes
 	COMP_WIDTH = frame_width/comparison_scale;
 	COMP_HEIGHT = frame_height/comparison_scale;
+	COMP_UNIT = 1 << (SOURCE->bits - 8); // high bit depth is compared natively, thresholds stay in 8-bit steps
+	if (COMP_WIDTH/max(1,PYRAMID_SCALE) < 8 || COMP_HEIGHT/max(1,PYRAMID_SCALE) < 8) PYRAMID_SCALE = 0; // too small to say anything alone
 	
 	// Match fps of input on output
-	FPS = CAP.get(CAP_PROP_FPS);
-	TOTAL_LENGTH = CAP.get(CAP_PROP_FRAME_COUNT);
+	FPS = SOURCE->fps;
+	TOTAL_LENGTH = SOURCE->length;
+	
+	// Time range, seeking lands on the preceding keyframe and the backend decodes forward to the requested frame
+	bool ranged = (range_start > 0 || range_end > 0);
+	if (ranged) {
+		if (range_end > 0) {
+			END_INDEX = lround(range_end*FPS);
+		}
+		if (range_start > 0) {
+			START_INDEX = SOURCE->seek(lround(range_start*FPS)); // trust where the backend actually landed
+		}
+		if (START_INDEX >= min(END_INDEX,TOTAL_LENGTH)) {
+			cout << "Requested range is empty, quitting..." << endl;
+			return -1;
+		}
+		TOTAL_LENGTH = min(END_INDEX,TOTAL_LENGTH) - START_INDEX;
+	}
+	// indexes stay absolute so drift, cadence phase and slot picks match a run over the whole file
+	READ_INDEX = START_INDEX - 1;
+	WRITE_INDEX = START_INDEX;
+	LAST_INDEX = START_INDEX;
 	
-	// Match codec by getting fourcc code
-	int fcc = CAP.get(CAP_PROP_FOURCC);
-	string fcc_s = format("%c%c%c%c", fcc & 255, (fcc >> 8) & 255, (fcc >> 16) & 255, (fcc >> 24) & 255);
+	// Downsampling in the same pass writes only the slots the target rate would keep, separately for each output
+	primary->target_fps = target_fps;
+	for (size_t i = 0; i < OUTPUTS.size(); i++) {
+		Output& out = *OUTPUTS[i];
+		if (out.target_fps > 0 && out.target_fps < FPS) {
+			out.slot_step.set(FPS/out.target_fps);
+		} else {
+			if (out.target_fps > 0) cout << "target_fps must be below the input fps, writing " << out.name << " at " << FPS << " fps" << endl;
+			out.target_fps = 0;
+			out.slot_step.set(1);
+		}
+		while (out.slot_step.pick(out.base) < START_INDEX) out.base++;
+		out.next_slot = out.slot_step.pick(out.base);
+	}
+	if (duplicate_count >= 1) {
+		CADENCE.set(duplicate_count);
+	} else {
+		// without an explicit count, each frame needs as many slots as the first output's target rate skips over
+		if (duplicate_count > 0) cout << "duplicate_count must be at least 1, using default value" << endl;
+		if (primary->target_fps > 0) CADENCE = primary->slot_step;
+		else CADENCE.set(2);
+	}
+	double output_fps = (primary->target_fps > 0) ? primary->target_fps : FPS;
 	
 	// Video output setup
-	// Use provided name and copied properties; should match input exactly with adjusted frames
-	VIDEO.open(output,VideoWriter::fourcc(fcc_s[0],fcc_s[1],fcc_s[2],fcc_s[3]),FPS,Size(frame_width,frame_height));
+	// Use provided name and copied properties, including the input's codec; should match input exactly with adjusted frames
+	for (size_t i = 0; i < OUTPUTS.size(); i++) {
+		Output& out = *OUTPUTS[i];
+		out.sink = openSink(out,*SOURCE,(out.target_fps > 0) ? out.target_fps : FPS,input);
+		if (out.sink == NULL) {
+			cout << "Error opening video output " << out.name << ", quitting..." << endl;
+			return -1;
+		}
+	}
 	
 	cout << std::fixed;
 	cout << std::setprecision(2);
 
 	// Initial reporting
 	cout << "Input: " << input << endl
-		<< "Output: " << output << endl
+		<< "Output: " << output;
+	for (size_t i = 1; i < OUTPUTS.size(); i++) {
+		cout << ", " << OUTPUTS[i]->name << " at " << (OUTPUTS[i]->target_fps > 0 ? OUTPUTS[i]->target_fps : FPS) << " fps";
+	}
+	cout << endl
 		<< "Length: " << TOTAL_LENGTH/FPS << "s, "
 		<< "Frames: " << TOTAL_LENGTH << ", "
+		<< "Start: " << START_INDEX/FPS << "s, "
 		<< "Fps: " << FPS << ", "
 		<< "Dimensions: " << frame_width << "x" << frame_height  << ", "
-		<< "Codec: " << fcc_s << endl;
+		<< "Codec: " << SOURCE->codec << ", "
+		<< "Depth: " << SOURCE->bits << "-bit" << endl;
+	printTopology();
+	
+	// Fit thresholds to this input's noise floor before starting
+	NOISE.rebase();
+	if (CALIBRATOR.window > 0) {
+		calibrateWindow(input,START_INDEX,CALIBRATOR.window);
+	}
 
 	cout << "Settings: " << endl
 		<< "buffer_size=" << buffer_size << ", "
 		<< "comparison_scale=" << comparison_scale << ", "
 		<< "adjustment_bound=" << adjustment_bound << ", "
-		<< "duplicate_count=" << duplicate_count << ", "
+		<< "duplicate_count=" << CADENCE.value() << ", "
 		<< "threshold_strict=" << THRESH.strict << ", "
-		<< "threshold_relaxed=" << THRESH.relaxed << endl;
+		<< "threshold_relaxed=" << THRESH.relaxed << ", "
+		<< "target_fps=" << output_fps << ", "
+		<< "cadence_lock=" << TRACKER.enabled << ", "
+		<< "calibrate=" << CALIBRATOR.window << ", "
+		<< "recalibrate=" << CALIBRATOR.interval << ", "
+		<< "comparison_filter=" << (AREA_FILTER ? "area" : "nearest") << ", "
+		<< "compare_chroma=" << COMPARE_CHROMA << ", "
+		<< "pyramid_scale=" << PYRAMID_SCALE << ", "
+		<< "sample_budget=" << SAMPLE_BUDGET << ", "
+		<< "noise_margin=" << NOISE.margin << ", "
+		<< "scene_cut=" << SCENES.ratio << ", "
+		<< "codec_hints=" << CODEC_HINTS << ", "
+		<< "cpus=" << (CPU_LIST.empty() ? "any" : cpus_arg) << ", "
+		<< "numa_node=" << NUMA_NODE << ", "
+		<< "huge_pages=" << HUGE_PAGES << ", "
+		<< "copy_audio=" << COPY_AUDIO << ", "
+		<< "vfr=" << primary->vfr << ", "
+		<< "encoder=" << (primary->encoder.name.empty() ? "input" : primary->encoder.name) << ", "
+		<< "encoder_threads=" << primary->encoder.threads << ", "
+		<< "preset=" << (primary->encoder.preset.empty() ? "default" : primary->encoder.preset) << ", "
+		<< "crf=" << primary->encoder.crf << ", "
+		<< "bitrate=" << primary->encoder.bitrate << ", "
+		<< "outputs=" << OUTPUTS.size() << ", "
+		<< "pipeline=" << (SOURCE->planar ? "yuv420p" : "bgr24") << endl;
+
+	// this thread matches from here on, everything that starts worker threads has been opened
+	placeThread(MATCH_STAGE);
+
+	// Frames circulate decode -> match -> encode for each output in turn -> decode; the pool covers the buffer,
+	// the frame held back while it's full, the frame being matched, every queue and the frame each other stage is working on
+	int outputs = OUTPUTS.size();
+	int pool_size = buffer_size + (outputs + 1)*QUEUE_DEPTH + outputs + 3;
+	FRAME_POOL.assign(pool_size,PooledFrame());
+	DECODED_QUEUE.reset(QUEUE_DEPTH);
+	for (int i = 0; i < outputs; i++) {
+		OUTPUTS[i]->queue = &ENCODE_QUEUES[i];
+		OUTPUTS[i]->queue->reset(QUEUE_DEPTH);
+	}
+	ENCODE_STAGES = outputs;
+	FREE_QUEUE.reset(pool_size);
+	for (int handle = 0; handle < pool_size; handle++) {
+		FREE_QUEUE.push(handle);
+	}
+	if (HUGE_PAGES) {
+		string backing = "heap";
+		backPool(*SOURCE,backing);
+		cout << "Frame pool: " << pool_size << " frames, " << POOL_BYTES/1048576.0 << " MB on " << backing << endl;
+	} else {
+		releasePool(); // an earlier -serve job's mapping this one won't use
+	}
 
 	// Start timer
-	thread(timeReportingManager).detach();
+	thread reporter(timeReportingManager);
 	
 	// Setup signal handling
 	struct sigaction sigIntHandler;
@@ -305,95 +2907,102 @@ int main(int argc, char* argv[]) {
 	sigaction(SIGINT,&sigIntHandler,NULL);
 
 	// Prepare for main loop
-	list<Frame*> buffer;
+	HINT_PRIORITY = CODEC_HINTS;
+	FrameRing buffer;
+	buffer.reset(buffer_size);
 	
-	Mat tempframe, compframe;
+	int held = -1; // handle of a new frame waiting for room in the buffer
 	double stdev = 0.0;
 	bool full = false; // ensures buffer doesn't overflow
-	bool fixing = true; // flag to track if fixing of frame is possible/happening
+	bool cutframe = false; // whether the held frame starts a new scene
 	int drift_update = 0; // counter will manage drift updating, will get reset to buffer or half buffer
 	
-	if (readFrame(CAP,tempframe,compframe)) {
+	int tlb_counter = openTlbCounter(); // only the stages are measured, so runs with and without huge_pages compare directly
+	thread decoder(decodeFrames);
+	vector<thread> encoders;
+	for (int i = 0; i < outputs; i++) {
+		encoders.push_back(thread(encodeFrames,i));
+	}
+	int current;
+	bool at_end = false; // the matcher has seen the decode stage's last handle
+	if (!nextFrame(current)) {
+		at_end = true;
+	} else {
 		// must read first frame for comparison and setup initial count
 		// could put .empty() check in matchFrames but that slows down all frame checking
-		Frame* temp = new Frame();
-		tempframe.copyTo(temp->data);
-		compframe.copyTo(temp->comp);
-		temp->count = 1;
-		temp->priority = stdev;
-		temp->index = READ_INDEX;
-		buffer.push_back(temp);
+		newFrame(buffer,current,framePriority(buffer,current,stdev),false);
 		
 		// Main loop goes frame-by-frame, checking match levels, filling buffer, and adjusting
 		while(!FINISHED) {
 			while(!full) { // this part will continue until the buffer is full
-				if (readFrame(CAP,tempframe,compframe)) { // read frame-by-frame
-					if (matchFrames(buffer.back()->comp,compframe,stdev)) { // check match
-						buffer.back()->count++; // increment duplicate count if a match
-						if (buffer.back()->count == duplicate_count) { // relax if goal reached
+				if (nextFrame(current)) { // read frame-by-frame
+					const PooledFrame& frame = FRAME_POOL[current];
+					bool match, measured = true;
+					int last = buffer.back();
+					const PooledFrame& previous = FRAME_POOL[buffer.handle[last]];
+					TRACKER.comparisons++;
+					if (CODEC_HINTS && frame.hinted && frame.still && sampleFrames(previous.comp,frame.comp)) {
+						// no motion and next to no residual, the encoder already found this to be a duplicate and a sampled check agrees
+						match = true;
+						measured = false;
+						PREFILTERED++;
+					} else if (TRACKER.expectsDuplicate(buffer.count[last])) {
+						// locked onto the cadence and this run isn't over yet, so only confirm the prediction
+						match = sampleFrames(previous.comp,frame.comp);
+						if (match) {
+							TRACKER.skipped++;
+							measured = false;
+						} else {
+							TRACKER.unlock(); // prediction missed, drop back to full comparisons until locked again
+							match = matchFrames(previous.comp,frame.comp,previous.coarse,frame.coarse,stdev);
+						}
+					} else {
+						match = matchFrames(previous.comp,frame.comp,previous.coarse,frame.coarse,stdev);
+					}
+					if (measured) CALIBRATOR.add(stdev); // periodic threshold re-estimation sees every full comparison
+					if (measured) NOISE.add(stdev); // the quantiles of every comparison show the noise floor
+					if (match) { // check match
+						buffer.count[last]++; // increment duplicate count if a match
+						if (buffer.count[last] >= buffer.required[last]) { // relax if goal reached
 							THRESH.makeRelaxed();
 						}
+						releaseFrame(current); // the buffered copy stands in for it
 					} else {
 						THRESH.makeStrict(); // always set back to strict when new frame
+						TRACKER.push(buffer.count[last]); // run of the previous frame is complete
+						cutframe = measured && SCENES.check(stdev,READ_INDEX);
 						if (buffer.size() < buffer_size) {
-							Frame* temp = new Frame();
-							tempframe.copyTo(temp->data);
-							compframe.copyTo(temp->comp);
-							temp->count = 1;
-							temp->priority = stdev;
-							temp->index = READ_INDEX;
-							buffer.push_back(temp);
+							newFrame(buffer,current,framePriority(buffer,current,stdev),cutframe);
 						} else {
+							held = current;
 							full = true;
 						}
 					}
 				} else {
-					full = true; // readFrame failed! probably end of file, so nothing more to fill
+					releaseFrame(current); // reading failed! probably end of file, so nothing more to fill
+					full = true;
 					FINISHED = true;
+					at_end = true;
 				}
 			}
 			drift_update--;
 			if (drift_update <= 0) {
-				DRIFT = WRITE_INDEX - buffer.front()->index;
+				DRIFT = WRITE_INDEX - buffer.index[buffer.front()];
 				drift_update = buffer_size; // only need to recheck after this buffer cleared since DRIFT is updated below
 			}
 			if (abs(DRIFT) < adjustment_bound) {
 				// adjustment phase, going one block at a time to try to fix potential lost frames
 				// adjustment could happen anywhere in the buffer, but will adjust frame in middle (still write from front, read into end)
 				// could easily use buffer.front() or buffer.back() or a pointer to any generic spot since the code below tries to fix using non-current frame regardless
-				list<Frame*>::iterator iter = buffer.begin();
-				advance(iter, buffer_size/2);
-				Frame* tofix = *iter;
-				fixing = true; // necessary to avoid infinite loop with dup adjusting
-				while (fixing && tofix->count < duplicate_count) {
-					fixing = false; // will do one step of frame adjustment each loop
-					// first, see if any other slot can offer this frame a place without risk of loss
-					for (list<Frame*>::reverse_iterator it = buffer.rbegin(); it != buffer.rend(); it++) {
-						if ((*it)->count > duplicate_count) { // no need to waste time checking *it == tofix; couldn't have entered this loop if tofix->count > dup count
-							(*it)->count--;
-							tofix->count++;
-							fixing = true;
-							break;
-						}
-					}
-					// if not, check priority and take a slot from a lower priority frame if need be
-					if (!fixing) {
-						for (list<Frame*>::reverse_iterator it = buffer.rbegin(); it != buffer.rend(); it++) {
-							if ((*it)->priority < tofix->priority && (*it)->count > 1) { // enforce that frames not allowed to be dropped with count > 1
-								(*it)->count--;
-								tofix->count++;
-								fixing = true;
-								break;
-							}
-						}
-					}
-				}
+				fillRequired(buffer,min(buffer_size/2,buffer.size() - 1),false); // the buffer can run short at the end of the input
 			} else if (DRIFT >= adjustment_bound) {
 				// over bound, so need to cut frames to correct drift
 				// go through the buffer, as long as drift is still too high, try to cut frames not at-risk
-				for (list<Frame*>::iterator it = buffer.begin(); DRIFT >= adjustment_bound && it != buffer.end(); it++) {
-					while ((*it)->count > duplicate_count) { // can shave off copies of current frame
-						(*it)->count--;
+				for (int position = 0; DRIFT >= adjustment_bound && position < buffer.size(); position++) {
+					int slot = buffer.at(position);
+					while (buffer.count[slot] > buffer.required[slot]) { // can shave off copies of current frame
+						buffer.count[slot]--;
+						planSlots(buffer,position + 1);
 						DRIFT--;
 						if (DRIFT < adjustment_bound) break; // can stop correcting drift
 					}
@@ -402,45 +3011,365 @@ int main(int argc, char* argv[]) {
 			} else {
 				// must be under bound, so need to add frames
 				// in this case, go through and add to at-risk frames from front to back
-				for (list<Frame*>::iterator it = buffer.begin(); abs(DRIFT) >= adjustment_bound && it != buffer.end(); it++) {
-					while ((*it)->count < duplicate_count) { // could add to here since at-risk already
-						(*it)->count++;
+				for (int position = 0; abs(DRIFT) >= adjustment_bound && position < buffer.size(); position++) {
+					int slot = buffer.at(position);
+					while (buffer.count[slot] < buffer.required[slot]) { // could add to here since at-risk already
+						buffer.count[slot]++;
+						planSlots(buffer,position + 1);
 						DRIFT++;
 						if (abs(DRIFT) < adjustment_bound) break; // can stop correcting drift
 					}
 				}
 			}
-			// write first frame
-			writeFrames(VIDEO,buffer.front()->data,buffer.front()->count);
-			delete buffer.front(); // free memory of Frame object
-			buffer.pop_front(); // clear record from list
+			// write first frame, once it has its required slots if any frame behind it can spare them
+			fillRequired(buffer,0,true);
+			writeFrames(buffer.handle[buffer.front()],buffer.count[buffer.front()]);
+			buffer.pop();
 			full = false;
-			// save the last new frame written into tempframe
-			Frame* temp = new Frame();
-			tempframe.copyTo(temp->data);
-			compframe.copyTo(temp->comp);
-			temp->count = 1;
-			temp->priority = stdev;
-			temp->index = READ_INDEX;
-			buffer.push_back(temp);
+			// add the new frame that didn't fit, unless the read failed and there's nothing held
+			if (held >= 0) {
+				newFrame(buffer,held,framePriority(buffer,held,stdev),cutframe);
+				held = -1;
+			}
 		}
 	}
 	FINISHED = true;
 	
 	// Cleanup stage
 	// write out any remaining frames and clear buffer
-	for (list<Frame*>::iterator it = buffer.begin(); it != buffer.end(); it++) {
-		writeFrames(VIDEO,(*it)->data,(*it)->count);
-		delete *it; // free memory of Frame object
+	// a requested range is written at exactly its length, so pieces concatenate back without drifting
+	int end_slot = READ_INDEX; // one past the last frame read
+	while (buffer.size() > 0) {
+		int slot = buffer.front();
+		fillRequired(buffer,0,true);
+		if (ranged) {
+			int remaining = max(0,end_slot - WRITE_INDEX);
+			if (buffer.size() == 1) buffer.count[slot] = remaining; // last frame absorbs any leftover drift
+			else buffer.count[slot] = min(buffer.count[slot],remaining);
+		} else if (buffer.size() == 1 && OUTPUTS[0]->target_fps > 0) {
+			// nothing after it to keep in step with, so the last frame may run a slot or two past the input to reach a pick
+			buffer.count[slot] = max(buffer.count[slot],buffer.required[slot]);
+		}
+		writeFrames(buffer.handle[slot],buffer.count[slot]);
+		buffer.pop();
+	}
+	// stopped by ctrl-c, the decode stage has ended early as well; hand back what it read ahead, up to its last handle
+	if (!at_end) {
+		while (nextFrame(current)) releaseFrame(current);
+		releaseFrame(current);
+	}
+	if (STOPPED) cout << "Stopped, finished writing " << WRITE_INDEX - START_INDEX << " frames" << endl;
+	EncodeJob end = {-1,WRITE_INDEX,0};
+	OUTPUTS[0]->queue->push(end);
+	for (int i = 0; i < outputs; i++) {
+		encoders[i].join();
+	}
+	decoder.join();
+	reporter.join();
+	buffer.reset(0);
+	FRAME_POOL.clear(); // release all frame memory
+	if (!SERVING) releasePool();
+	long long tlb_misses = -1;
+	if (tlb_counter >= 0) {
+		if (read(tlb_counter,&tlb_misses,sizeof(tlb_misses)) != sizeof(tlb_misses)) tlb_misses = -1;
+		close(tlb_counter);
+	}
+	
+	for (int i = 0; i < outputs; i++) {
+		const Output& out = *OUTPUTS[i];
+		if (outputs > 1) cout << out.name << ": " << out.index << " frames written at " << (out.target_fps > 0 ? out.target_fps : FPS) << " fps" << endl;
+		else if (out.target_fps > 0) cout << out.index << " frames written at " << out.target_fps << " fps" << endl;
 	}
-	buffer.clear(); // clear all records from list
+	if (SAMPLE_BUDGET > 0 && SAMPLED_COMPARISONS > 0) {
+		cout << "sampled comparison stopped early on " << SAMPLED_EARLY << " of " << SAMPLED_COMPARISONS << " comparisons, "
+			<< "visiting " << 100.0*SAMPLED_ROWS/max(1LL,(long long)SAMPLED_TOTAL_ROWS) << "% of rows" << endl;
+	}
+	if (CODEC_HINTS) {
+		cout << "codec statistics found " << PREFILTERED << " duplicates that only needed a sampled check" << endl;
+	}
+	if (SCENES.ratio > 0) {
+		// cuts are where a long input can be split into -ss/-to pieces without changing any allocation
+		cout << SCENES.cuts.size() << " scene cuts detected";
+		for (size_t i = 0; i < SCENES.cuts.size(); i++) {
+			cout << (i == 0 ? " at " : ", ") << std::setprecision(3) << SCENES.cuts[i]/FPS << "s";
+		}
+		cout << std::setprecision(2) << endl;
+	}
+	if (NOISE.margin > 0) {
+		cout << "noise tracking moved the thresholds " << NOISE.adjustments << " times, highest threshold_strict="
+			<< max(NOISE.highest,THRESH.strict) << ", final noise floor=" << NOISE.floor << ", changes=" << NOISE.ceiling << endl;
+	}
+	if (PYRAMID_SCALE > 1) {
+		cout << "comparison pyramid decided " << PYRAMID_DECIDED << " comparisons at the coarse level, "
+			<< PYRAMID_DESCENDED << " needed the finer level" << endl;
+	}
+	if (TRACKER.enabled) {
+		cout << "cadence lock skipped " << TRACKER.skipped << " of " << TRACKER.comparisons << " comparisons, "
+			<< TRACKER.misses << " missed predictions" << endl;
+	}
+	if (tlb_misses >= 0) {
+		cout << "dTLB load misses: " << tlb_misses << ", " << (double)tlb_misses/max(1,READ_INDEX - START_INDEX) << " per frame" << endl;
+	}
+	// a full decode queue means matching is the slowest stage, a full encode queue means encoding is
+	cout << "decode queue averaged " << (double)DECODED_QUEUE.occupancy/max<uint64_t>(1,DECODED_QUEUE.pushes)
+		<< " of " << QUEUE_DEPTH << " frames (peak " << DECODED_QUEUE.peak << ", parked " << DECODED_QUEUE.parks << " times)";
+	for (int i = 0; i < outputs; i++) {
+		const SpscRing<EncodeJob>& queue = *OUTPUTS[i]->queue;
+		cout << ", encode queue" << (outputs > 1 ? " of " + OUTPUTS[i]->name : string()) << " averaged "
+			<< (double)queue.occupancy/max<uint64_t>(1,queue.pushes)
+			<< " of " << QUEUE_DEPTH << " frames (peak " << queue.peak << ", parked " << queue.parks << " times)";
+	}
+	cout << endl;
 	
 	// release video devices
-	CAP.release();
-	VIDEO.release();
+	SOURCE->release();
+	for (int i = 0; i < outputs; i++) {
+		OUTPUTS[i]->sink->release();
+	}
+	delete SOURCE;
+	SOURCE = NULL;
+	for (int i = 0; i < outputs; i++) {
+		delete OUTPUTS[i]->sink;
+		delete OUTPUTS[i];
+	}
+	OUTPUTS.clear();
 	
 	// Closes all the windows
 	destroyAllWindows();
-	return 0;
+	return STOPPED ? 1 : 0;
 	
 }
+
+// Sends what a job prints down its client's socket, a line at a time
+// unbuffered as far as the stream is concerned, so the reporter and the main thread can both write through the lock
+class SocketBuffer : public streambuf {
+public:
+	explicit SocketBuffer(int fd) : fd(fd) {}
+	~SocketBuffer() {
+		sync();
+	}
+protected:
+	int overflow(int c) {
+		if (c == EOF) return 0;
+		char ch = (char)c;
+		xsputn(&ch,1);
+		return c;
+	}
+	streamsize xsputn(const char* s, streamsize n) {
+		lock_guard<mutex> lock(guard);
+		pending.append(s,n);
+		if (memchr(s,'\n',n) != NULL) send();
+		return n;
+	}
+	int sync() {
+		lock_guard<mutex> lock(guard);
+		send();
+		return 0;
+	}
+private:
+	int fd;
+	string pending;
+	mutex guard;
+	bool connected = true; // a client that hung up just stops getting output, the job carries on
+	void send() {
+		size_t done = 0;
+		while (connected && done < pending.size()) {
+			ssize_t sent = write(fd,pending.data() + done,pending.size() - done);
+			if (sent < 0 && errno == EINTR) continue;
+			if (sent <= 0) connected = false; // including a client that stopped reading for JOB_TIMEOUT seconds
+			else done += sent;
+		}
+		pending.clear();
+	}
+};
+
+// Fills in the address of a Unix socket, false if the path doesn't fit
+bool socketAddress(const string& path, sockaddr_un& address) {
+	memset(&address,0,sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+		cout << "socket path must be 1 to " << sizeof(address.sun_path) - 1 << " characters long: " << path << endl;
+		return false;
+	}
+	memcpy(address.sun_path,path.c_str(),path.size());
+	return true;
+}
+
+// Reads the line a client sends, up to the first newline or until it closes its side
+// gives up with what it has after JOB_TIMEOUT seconds of silence, so a client that never sends can't hold up the queue
+string readJob(int client) {
+	string line;
+	char c;
+	while (line.size() < 65536) {
+		ssize_t got = read(client,&c,1);
+		if (got < 0 && errno == EINTR && !STOPPED) continue;
+		if (got != 1 || c == '\n') break;
+		line += c;
+	}
+	return line;
+}
+
+// Splits a job line into arguments at whitespace, double quotes keep an argument with spaces together
+vector<string> splitJob(const string& line) {
+	vector<string> args;
+	string arg;
+	bool quoted = false, started = false;
+	for (size_t i = 0; i < line.size(); i++) {
+		char c = line[i];
+		if (c == '"') {
+			quoted = !quoted;
+			started = true;
+		} else if (!quoted && isspace((unsigned char)c)) {
+			if (started) args.push_back(arg);
+			arg.clear();
+			started = false;
+		} else {
+			arg += c;
+			started = true;
+		}
+	}
+	if (started) args.push_back(arg);
+	return args;
+}
+
+// Runs jobs from a Unix socket one after another in this process, so short clips don't each pay for loading
+// and initializing OpenCV and libav, OpenCV's thread pool, or faulting in a huge page frame pool
+// a job is one line holding the arguments of a normal run; its log goes back over the connection, ending with
+// "job <n> done" or "job <n> failed, status <s>", and a line of just "quit" stops the server
+int serve(const string& path) {
+	sockaddr_un address;
+	if (!socketAddress(path,address)) return 1;
+	struct stat info;
+	if (stat(path.c_str(),&info) == 0 && S_ISSOCK(info.st_mode)) {
+		// only a socket nothing answers on is left behind by an earlier server, one that answers is still in use
+		int probe = socket(AF_UNIX,SOCK_STREAM,0);
+		bool refused = (probe >= 0 && connect(probe,(sockaddr*)&address,sizeof(address)) != 0 && errno == ECONNREFUSED);
+		if (probe >= 0) close(probe);
+		if (!refused) {
+			cout << "A server is already listening on " << path << ", or it can't be checked; not replacing it" << endl;
+			return 1;
+		}
+		unlink(path.c_str());
+	}
+	int listener = socket(AF_UNIX,SOCK_STREAM,0);
+	if (listener < 0 || bind(listener,(sockaddr*)&address,sizeof(address)) != 0 || listen(listener,16) != 0) {
+		cout << "Unable to listen on " << path << ": " << strerror(errno) << endl;
+		if (listener >= 0) close(listener);
+		return 1;
+	}
+	signal(SIGPIPE,SIG_IGN); // writes to a client that hung up fail instead of ending the server
+	// ctrl-c between jobs interrupts accept(), during one it winds the job down like a normal run does;
+	// either way the server then stops and removes its socket
+	struct sigaction sigIntHandler;
+	sigIntHandler.sa_handler = signal_handler;
+	sigemptyset(&sigIntHandler.sa_mask);
+	sigIntHandler.sa_flags = 0;
+	sigaction(SIGINT,&sigIntHandler,NULL);
+#ifdef __linux__
+	cpu_set_t affinity; // -cpus and -numa_node pin this thread for a job, the next one starts from here again
+	bool pinned = (pthread_getaffinity_np(pthread_self(),sizeof(affinity),&affinity) == 0);
+#endif
+	SERVING = true;
+	cout << "Serving jobs on " << path << endl;
+	int jobs = 0;
+	while (!STOPPED) {
+		int client = accept(listener,NULL,NULL);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			cout << "Unable to accept jobs: " << strerror(errno) << endl;
+			break;
+		}
+		timeval timeout = {JOB_TIMEOUT,0};
+		setsockopt(client,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+		setsockopt(client,SOL_SOCKET,SO_SNDTIMEO,&timeout,sizeof(timeout));
+		string line = readJob(client);
+		vector<string> args = splitJob(line);
+		if (STOPPED || (args.size() == 1 && args[0] == "quit")) {
+			close(client);
+			break;
+		}
+		if (args.empty()) {
+			close(client); // timed out or hung up before sending a job
+			continue;
+		}
+		jobs++;
+		int status;
+		{
+			SocketBuffer log(client);
+			streambuf* console = cout.rdbuf(&log);
+			cout << "job " << jobs << " started" << endl;
+			vector<char*> argv(1,(char*)"framefixer");
+			for (size_t i = 0; i < args.size(); i++) argv.push_back(&args[i][0]);
+			status = run(argv.size(),argv.data());
+			if (status == 0) cout << "job " << jobs << " done" << endl;
+			else cout << "job " << jobs << " failed, status " << status << endl;
+			cout.rdbuf(console);
+		}
+		close(client);
+#ifdef __linux__
+		if (pinned) pthread_setaffinity_np(pthread_self(),sizeof(affinity),&affinity);
+#endif
+		cout << "job " << jobs << ": " << line << (status == 0 ? ", done" : ", failed") << endl;
+	}
+	if (STOPPED) cout << "Stopped, no longer serving jobs on " << path << endl;
+	close(listener);
+	unlink(path.c_str());
+	resetState();
+	releasePool();
+	return 0;
+}
+
+// Hands one job to a running -serve and prints its log as it arrives
+// exits with 0 only if the job succeeded, so it can replace a normal invocation under a job runner
+int submit(const string& path, int argc, char* argv[]) {
+	sockaddr_un address;
+	if (!socketAddress(path,address)) return 1;
+	int server = socket(AF_UNIX,SOCK_STREAM,0);
+	if (server < 0 || connect(server,(sockaddr*)&address,sizeof(address)) != 0) {
+		cout << "Unable to reach a server on " << path << ": " << strerror(errno) << endl;
+		if (server >= 0) close(server);
+		return 1;
+	}
+	string job;
+	for (int i = 0; i < argc; i++) {
+		string arg = argv[i];
+		if (i > 0) job += " ";
+		job += (arg.empty() || arg.find_first_of(" \t") != string::npos) ? "\"" + arg + "\"" : arg;
+	}
+	job += "\n";
+	size_t done = 0;
+	while (done < job.size()) {
+		ssize_t sent = write(server,job.data() + done,job.size() - done);
+		if (sent < 0 && errno == EINTR) continue;
+		if (sent <= 0) break;
+		done += sent;
+	}
+	// the last line of the log is the job's status
+	string line, last;
+	char chunk[4096];
+	ssize_t got;
+	while ((got = read(server,chunk,sizeof(chunk))) != 0) {
+		if (got < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		cout.write(chunk,got);
+		for (ssize_t i = 0; i < got; i++) {
+			if (chunk[i] != '\n') line += chunk[i];
+			else if (!line.empty()) {
+				last = line;
+				line.clear();
+			}
+		}
+	}
+	cout.flush();
+	close(server);
+	bool succeeded = (last.compare(0,4,"job ") == 0 && last.size() > 5 && last.compare(last.size() - 5,5," done") == 0);
+	return succeeded ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc == 3 && string(argv[1]) == "-serve") return serve(argv[2]);
+	if (argc >= 3 && string(argv[1]) == "-submit") return submit(argv[2],argc - 3,argv + 3);
+	return run(argc,argv);
+}
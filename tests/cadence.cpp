@@ -0,0 +1,141 @@
+// Checks that every content frame reaches the output under a rational cadence, and times the slot bookkeeping
+// builds against framefixer.cpp itself, e.g. from this directory:
+//   g++ -std=c++11 -O2 $(pkg-config --cflags opencv4) cadence.cpp $(pkg-config --libs opencv4) -pthread -o cadence
+//   ./cadence          runs the checks, exits with 1 if any fails
+//   ./cadence bench    also times planSlots over a full buffer
+#include <set>
+#define main framefixer_main
+#include "../framefixer.cpp"
+#undef main
+
+const int WIDTH = 64, HEIGHT = 48;
+int failures = 0;
+
+void check(bool ok, const string& what) {
+	cout << (ok ? "ok    " : "FAIL  ") << what << endl;
+	if (!ok) failures++;
+}
+
+// Writes 60 fps y4m where content frame i is random noise repeated runs[i] times
+void writeInput(const string& name, const vector<int>& runs) {
+	ofstream file(name.c_str(),ios::binary);
+	file << "YUV4MPEG2 W" << WIDTH << " H" << HEIGHT << " F60:1 Ip A1:1 C420jpeg\n";
+	vector<char> frame(WIDTH*HEIGHT*3/2,(char)128);
+	uint32_t seed = 1;
+	for (size_t i = 0; i < runs.size(); i++) {
+		for (int p = 0; p < WIDTH*HEIGHT; p++) {
+			seed = seed*1664525 + 1013904223;
+			frame[p] = (char)(seed >> 24);
+		}
+		for (int r = 0; r < runs[i]; r++) {
+			file << "FRAME\n";
+			file.write(frame.data(),frame.size());
+		}
+	}
+}
+
+// Luma of every frame in a y4m written by the program
+vector<string> readOutput(const string& name) {
+	ifstream file(name.c_str(),ios::binary);
+	string header;
+	getline(file,header);
+	vector<string> frames;
+	string marker;
+	vector<char> frame(WIDTH*HEIGHT*3/2);
+	while (getline(file,marker) && file.read(frame.data(),frame.size())) frames.push_back(string(frame.data(),WIDTH*HEIGHT));
+	return frames;
+}
+
+// Runs the program quietly on one input and returns the distinct frames among the slots a decimation picks
+size_t distinctFrames(const string& input, const vector<string>& options, const Cadence& picks) {
+	vector<string> args = {"framefixer",input,"cadence_out.y4m"};
+	args.insert(args.end(),options.begin(),options.end());
+	vector<char*> argv;
+	for (size_t i = 0; i < args.size(); i++) argv.push_back(&args[i][0]);
+	stringstream log;
+	streambuf* console = cout.rdbuf(log.rdbuf());
+	run(argv.size(),argv.data());
+	cout.rdbuf(console);
+	vector<string> frames = readOutput("cadence_out.y4m");
+	remove("cadence_out.y4m");
+	set<string> distinct;
+	for (long long k = 0; picks.pick(k) < (long long)frames.size(); k++) distinct.insert(frames[picks.pick(k)]);
+	return distinct.size();
+}
+
+void checkPicks() {
+	const long long ratios[][2] = {{2,1},{5,2},{5,3},{1001,400}};
+	for (int r = 0; r < 4; r++) {
+		Cadence cadence;
+		cadence.num = ratios[r][0];
+		cadence.den = ratios[r][1];
+		bool ok = true;
+		long long k = 0;
+		for (long long s = 0; s < 10000; s++) {
+			while (cadence.pick(k) < s) k++;
+			ok = ok && (cadence.nextPick(s) == cadence.pick(k));
+		}
+		check(ok,cv::format("nextPick is the first pick at or after every slot for %lld/%lld",ratios[r][0],ratios[r][1]));
+	}
+}
+
+void checkCoverage() {
+	const int CONTENT = 480;
+	vector<int> regular, paired;
+	uint32_t seed = 7;
+	for (int i = 0; i < CONTENT/2; i++) {
+		regular.push_back(3);
+		regular.push_back(2);
+		seed = seed*1664525 + 1013904223;
+		paired.push_back((seed >> 31) ? 3 : 2); // each pair still spans 5 slots, but which frame gets 3 varies
+		paired.push_back(5 - paired.back());
+	}
+	Cadence film, full;
+	film.set(2.5);
+	full.set(1);
+	const vector<int>* inputs[2] = {&regular, &paired};
+	const char* names[2] = {"regular 3:2", "jittered 3:2"};
+	for (int i = 0; i < 2; i++) {
+		writeInput("cadence_in.y4m",*inputs[i]);
+		size_t kept = distinctFrames("cadence_in.y4m",{"-target_fps","24"},full);
+		check(kept == CONTENT,cv::format("%s at -target_fps 24 keeps %d of %d content frames",names[i],(int)kept,CONTENT));
+		kept = distinctFrames("cadence_in.y4m",{"-duplicate_count","2.5"},film);
+		check(kept == CONTENT,cv::format("%s at full rate keeps %d of %d content frames at the picked slots",names[i],(int)kept,CONTENT));
+		remove("cadence_in.y4m");
+	}
+}
+
+// planSlots walks the buffer after every change to a count, so it's timed over a full buffer of the default size
+void benchmark() {
+	Output output;
+	output.target_fps = 24;
+	output.slot_step.set(2.5);
+	OUTPUTS.assign(1,&output);
+	FrameRing buffer;
+	buffer.reset(7);
+	FRAME_POOL.resize(7);
+	for (int i = 0; i < 7; i++) {
+		FRAME_POOL[i].index = i;
+		newFrame(buffer,i,0.0,false);
+	}
+	const int ROUNDS = 10000000;
+	chrono::time_point<chrono::steady_clock> start = chrono::steady_clock::now();
+	long long total = 0;
+	for (int i = 0; i < ROUNDS; i++) {
+		WRITE_INDEX = i;
+		buffer.count[buffer.at(i % 7)] = 1 + (i & 1);
+		planSlots(buffer);
+		total += buffer.required[buffer.front()];
+	}
+	chrono::duration<double,nano> elapsed = chrono::steady_clock::now() - start;
+	cout << "planSlots over 7 frames: " << elapsed.count()/ROUNDS << " ns (" << total << ")" << endl;
+	OUTPUTS.clear();
+	FRAME_POOL.clear();
+}
+
+int main(int argc, char* argv[]) {
+	checkPicks();
+	checkCoverage();
+	if (argc > 1 && string(argv[1]) == "bench") benchmark();
+	return failures > 0 ? 1 : 0;
+}